@@ -112,7 +112,7 @@ public:
 	int Convert();
 
 	void EnableExtHeader() { hasExtHeader = true; }
-	int WriteExtHeader(const char* smdhFile, const char* romfsDir);
+	int WriteExtHeader(const char* smdhFile, const char* romfsDir, const romfs_opts_t& romfsOpts);
 };
 
 int ElfConvert::ScanRelocSection(u32 vsect, u32 vsectend, byte_t* sectData, Elf32_Sym* symTab, Elf32_Rel* relTab, int relCount)
@@ -457,7 +457,7 @@ int ElfConvert::Convert()
 	return 0;
 }
 
-int ElfConvert::WriteExtHeader(const char* smdhFile, const char* romfsDir)
+int ElfConvert::WriteExtHeader(const char* smdhFile, const char* romfsDir, const romfs_opts_t& romfsOpts)
 {
 	FILE* f = fopen(smdhFile, "rb");
 	if (!f) die("Cannot open SMDH file!");
@@ -512,18 +512,23 @@ int ElfConvert::WriteExtHeader(const char* smdhFile, const char* romfsDir)
 
 			if (!romfsFile.openerror())
 			{
-				/* get the file size */
-				romfsFile.Seek(0, SEEK_END);
-				int size = ftell(romfsFile.get_ptr());
-				romfsFile.Seek(0, SEEK_SET);
-
-				/* create the buffer */
-				uint8_t* file_data = (uint8_t*)malloc(size);
-
-				romfsFile.ReadRaw(file_data, size);
-				fout.WriteRaw(file_data, size);
-
-				free(file_data);
+				/* copy it over in pieces, it can be larger than the memory budget */
+				size_t bufSize = 0x100000;
+				if (romfsOpts.maxMemory && romfsOpts.maxMemory < bufSize)
+					bufSize = romfsOpts.maxMemory < 0x1000 ? 0x1000 : (size_t)romfsOpts.maxMemory;
+				std::vector<u8> buf(bufSize);
+				for (;;)
+				{
+					size_t size = fread(&buf.front(), 1, bufSize, romfsFile.get_ptr());
+					if (size && !fout.WriteRaw(&buf.front(), size))
+						die("Could not write output file");
+					if (size < bufSize) break;
+				}
+				if (ferror(romfsFile.get_ptr()))
+				{
+					fprintf(stderr, "Failed to read RomFS image %s!\n", romfsDir);
+					return 1;
+				}
 
 				return 0;
 			}
@@ -534,7 +539,7 @@ int ElfConvert::WriteExtHeader(const char* smdhFile, const char* romfsDir)
 			}
 		}
 
-		RomFS romfs;
+		RomFS romfs(romfsOpts);
 		safe_call(romfs.Build(romfsDir));
 		safe_call(romfs.WriteToFile(fout));
 	}
@@ -548,6 +553,7 @@ struct argInfo
 	char* elfFile;
 	char* smdhFile;
 	char* romfsDir;
+	romfs_opts_t romfsOpts;
 };
 
 int usage(const char* progName)
@@ -558,13 +564,18 @@ int usage(const char* progName)
 		"Options:\n"
 		"    --smdh=input.smdh : Embeds SMDH metadata into the output file.\n"
 		"    --romfs=input     : Embeds RomFS from a directory or raw RomFS archive into the output file.\n"
+		"    --max-memory=SIZE : Upper bound on the RomFS file contents held in memory at once, K/M/G\n"
+		"                        suffixes allowed (default: no limit).\n"
 		, progName);
 	return 1;
 }
 
 int parseArgs(argInfo& info, int argc, char* argv[])
 {
-	memset(&info, 0, sizeof(info));
+	info.outFile = NULL;
+	info.elfFile = NULL;
+	info.smdhFile = NULL;
+	info.romfsDir = NULL;
 
 	int status = 0;
 	for (int i = 1; i < argc; i ++)
@@ -582,6 +593,10 @@ int parseArgs(argInfo& info, int argc, char* argv[])
 				info.smdhFile = value;
 			else if (strcmp(arg, "romfs")==0)
 				info.romfsDir = value;
+			else if (strcmp(arg, "max-memory")==0)
+			{
+				if (!parseSize(value, info.romfsOpts.maxMemory) || !info.romfsOpts.maxMemory) return usage(argv[0]);
+			}
 			else
 				return usage(argv[0]);
 		} else
@@ -627,7 +642,7 @@ int main(int argc, char* argv[])
 		if (rc != 0) break;
 
 		if (hasExtHeader)
-			rc = cnv.WriteExtHeader(args.smdhFile, args.romfsDir);
+			rc = cnv.WriteExtHeader(args.smdhFile, args.romfsDir, args.romfsOpts);
 	} while(0);
 	free(b);
 
@@ -2,11 +2,30 @@
 #include <stdio.h>
 #include "types.h"
 
+// Seeking with 64-bit offsets, long only has 32 bits on Windows
+static inline int fseek64(FILE* f, s64 pos, int mode)
+{
+#ifdef WIN32
+	return _fseeki64(f, pos, mode);
+#else
+	return fseeko(f, (off_t)pos, mode);
+#endif
+}
+
+static inline s64 ftell64(FILE* f)
+{
+#ifdef WIN32
+	return _ftelli64(f);
+#else
+	return ftello(f);
+#endif
+}
+
 class FileClass
 {
 	FILE* f;
 	bool LittleEndian, own;
-	int filePos;
+	s64 filePos;
 
 	size_t _RawRead(void* buffer, size_t size)
 	{
@@ -93,7 +112,7 @@ public:
 	bool ReadRaw(void* buffer, size_t size) { return _RawRead(buffer, size) == size; }
 	bool WriteRaw(const void* buffer, size_t size) { return _RawWrite(buffer, size) == size; }
 
-	void Seek(int pos, int mode) { fseek(f, pos, mode); }
-	int Tell() { return filePos /*ftell(f)*/; }
+	void Seek(s64 pos, int mode) { fseek64(f, pos, mode); filePos = ftell64(f); }
+	s64 Tell() { return filePos /*ftell(f)*/; }
 	void Flush() { fflush(f); }
 };
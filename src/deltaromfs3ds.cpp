@@ -0,0 +1,640 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <string>
+#include <map>
+#include <set>
+#include <algorithm>
+#include "types.h"
+#include "romfs.h"
+#include "romfsreader.h"
+#include "sha256.h"
+
+#ifdef WIN32
+#include <io.h>
+#endif
+
+#define die(msg) do { fputs(msg "\n\n", stderr); return 1; } while(0)
+#define safe_call(a) do { int rc = a; if(rc != 0) return rc; } while(0)
+
+// A patch rebuilds the new image from front to back out of three kinds of
+// ranges: bytes found in the old image, bytes stored in the patch and zero
+// padding. Ranges that are already at the right place in the old image
+// copy from their own offset, so applying a patch in place only has to
+// touch what actually changed.
+//
+// Layout, all little endian:
+//   0x00 "RFDL", version
+//   0x08 old image size, new image size
+//   0x18 SHA-256 of the old metadata, SHA-256 of the new metadata
+//   0x58 old metadata size, new metadata size
+//   0x60 number of ops, then 0x40 bytes per op: type, 0, dst, len, src and
+//        the SHA-256 of the bytes it produces (zero for DELTA_ZERO)
+//   followed by the data of every DELTA_DATA op in op order
+#define DELTA_MAGIC "RFDL"
+#define DELTA_VERSION 2
+#define DELTA_HEADER_SIZE 0x68
+#define DELTA_OP_SIZE 0x40
+#define DELTA_BLOCK 0x1000 // Granularity at which changes are detected
+
+enum
+{
+	DELTA_COPY = 0, // Take len bytes from src in the old image
+	DELTA_DATA = 1, // Take len bytes from the patch
+	DELTA_ZERO = 2, // Zero fill
+};
+
+struct delta_op_t
+{
+	u32 type;
+	u64 dst, len, src;
+	u8 hash[SHA256_HASH_SIZE];
+};
+
+struct argInfo
+{
+	char* oldFile;
+	char* newFile;
+	char* patchFile;
+	bool apply;
+	bool verify;
+};
+
+int usage(const char* progName)
+{
+	fprintf(stderr,
+		"Usage:\n"
+		"    %s old.romfs new.romfs output.patch\n"
+		"    %s --apply [--verify] old.romfs input.patch [output.romfs]\n\n"
+		"Creates a patch that turns one RomFS image into another, or applies one. Files are\n"
+		"matched by path and by contents, so moved, renamed and unchanged files cost nothing.\n"
+		"Without output.romfs the patch is applied to old.romfs in place, which only rewrites\n"
+		"the parts of the image that changed.\n"
+		"Everything the patch reads is checked against the hashes it recorded first. In place,\n"
+		"data that stays where it is only gets checked with --verify, which reads the whole image.\n"
+		, progName, progName);
+	return 1;
+}
+
+int parseArgs(argInfo& info, int argc, char* argv[])
+{
+	info.oldFile = NULL;
+	info.newFile = NULL;
+	info.patchFile = NULL;
+	info.apply = false;
+	info.verify = false;
+
+	char* files[3] = { NULL, NULL, NULL };
+	int status = 0;
+	for (int i = 1; i < argc; i ++)
+	{
+		char* arg = argv[i];
+		if (arg[0] == '-' && arg[1] == '-')
+		{
+			if (strcmp(arg + 2, "apply")==0)
+				info.apply = true;
+			else if (strcmp(arg + 2, "verify")==0)
+				info.verify = true;
+			else
+				return usage(argv[0]);
+		} else if (status < 3)
+			files[status++] = arg;
+		else
+			return usage(argv[0]);
+	}
+
+	info.oldFile = files[0];
+	if (info.apply)
+	{
+		info.patchFile = files[1];
+		info.newFile = files[2];
+		return status < 2 ? usage(argv[0]) : 0;
+	}
+	info.newFile = files[1];
+	info.patchFile = files[2];
+	return status < 3 ? usage(argv[0]) : 0;
+}
+
+static inline u32 getWord(const u8* p)
+{
+	u32 value;
+	memcpy(&value, p, 4);
+	return le_word(value);
+}
+
+static inline u64 getDword(const u8* p)
+{
+	u64 value;
+	memcpy(&value, p, 8);
+	return le_dword(value);
+}
+
+static inline u8* putWord(u8* p, u32 value)
+{
+	value = le_word(value);
+	memcpy(p, &value, 4);
+	return p + 4;
+}
+
+static inline u8* putDword(u8* p, u64 value)
+{
+	value = le_dword(value);
+	memcpy(p, &value, 8);
+	return p + 8;
+}
+
+struct delta_file_t
+{
+	std::string path;
+	u64 offset, size; // Within the image
+};
+
+// Collects every file of an image along with its path
+static int listFiles(const RomFSReader& reader, std::vector<delta_file_t>& out)
+{
+	std::vector< std::pair<u32, std::string> > stack;
+	u32 dirCount = 0;
+	stack.push_back(std::make_pair(0u, std::string()));
+	while (!stack.empty())
+	{
+		u32 off = stack.back().first;
+		std::string path = stack.back().second;
+		stack.pop_back();
+
+		romfs_dir_info_t dir;
+		safe_call(reader.GetDir(off, dir));
+		for (u32 child = dir.firstFile; child != ROMFS_NONE; )
+		{
+			romfs_file_info_t file;
+			safe_call(reader.GetFile(child, file));
+			delta_file_t ent;
+			ent.path = path + "/";
+			romfsNameToUtf8(ent.path, file.name, file.nameLen);
+			ent.offset = reader.DataOffset() + file.dataOff;
+			ent.size = file.dataSize;
+			out.push_back(ent);
+			if (out.size() > reader.MaxFiles()) die("Corrupted RomFS image");
+			child = file.sibling;
+		}
+		for (u32 child = dir.firstSubDir; child != ROMFS_NONE; )
+		{
+			romfs_dir_info_t sub;
+			safe_call(reader.GetDir(child, sub));
+			std::string subPath = path + "/";
+			romfsNameToUtf8(subPath, sub.name, sub.nameLen);
+			stack.push_back(std::make_pair(child, subPath));
+			if (++dirCount > reader.MaxDirs()) die("Corrupted RomFS image");
+			child = sub.sibling;
+		}
+	}
+	return 0;
+}
+
+static std::string hashKey(const u8* data, u64 size)
+{
+	u8 hash[SHA256_HASH_SIZE];
+	sha256(data, size, hash);
+	return std::string((const char*)hash, SHA256_HASH_SIZE) + std::string((const char*)&size, sizeof(size));
+}
+
+struct delta_ctx_t
+{
+	const u8 *oldImg, *newImg;
+	u64 oldSize, newSize;
+	std::vector<delta_op_t> ops;
+};
+
+static void addOp(delta_ctx_t& ctx, u32 type, u64 dst, u64 len, u64 src)
+{
+	if (!ctx.ops.empty())
+	{
+		delta_op_t& last = ctx.ops.back();
+		if (last.type == type && last.dst + last.len == dst && (type != DELTA_COPY || last.src + last.len == src))
+		{
+			last.len += len;
+			return;
+		}
+	}
+	delta_op_t op = { type, dst, len, src, { 0 } };
+	ctx.ops.push_back(op);
+}
+
+static bool isZero(const u8* data, u64 len)
+{
+	for (u64 i = 0; i < len; i ++)
+		if (data[i]) return false;
+	return true;
+}
+
+// Describes the range [dst, dst+len) of the new image block by block.
+// Blocks the old image already has at the same offset stay where they are,
+// otherwise hint is where the old image may hold them (DELTA_NO_HINT if
+// it is not known).
+#define DELTA_NO_HINT (~(u64)0)
+
+static void addRange(delta_ctx_t& ctx, u64 dst, u64 len, u64 hint)
+{
+	for (u64 pos = 0; pos < len; )
+	{
+		u64 size = len - pos < DELTA_BLOCK ? len - pos : DELTA_BLOCK;
+		u64 at = dst + pos;
+		const u8* data = ctx.newImg + at;
+
+		if (at + size <= ctx.oldSize && memcmp(ctx.oldImg + at, data, size) == 0)
+			addOp(ctx, DELTA_COPY, at, size, at);
+		else if (hint != DELTA_NO_HINT && hint + pos + size <= ctx.oldSize && memcmp(ctx.oldImg + hint + pos, data, size) == 0)
+			addOp(ctx, DELTA_COPY, at, size, hint + pos);
+		else if (isZero(data, size))
+			addOp(ctx, DELTA_ZERO, at, size, 0);
+		else
+			addOp(ctx, DELTA_DATA, at, size, 0);
+		pos += size;
+	}
+}
+
+struct file_order_t
+{
+	const std::vector<delta_file_t>& files;
+
+	file_order_t(const std::vector<delta_file_t>& files) : files(files) { }
+	bool operator()(size_t a, size_t b) const { return files[a].offset < files[b].offset; }
+};
+
+static int diff(const char* oldFile, const char* newFile, const char* patchFile)
+{
+	RomFSReader oldReader, newReader;
+#ifdef WIN32
+	WCHAR oldPath[OSPATHLEN], newPath[OSPATHLEN];
+	if (!MultiByteToWideChar(CP_ACP, 0, oldFile, -1, oldPath, OSPATHLEN) ||
+		!MultiByteToWideChar(CP_ACP, 0, newFile, -1, newPath, OSPATHLEN))
+		die("Cannot convert to Unicode");
+#else
+	const char* oldPath = oldFile;
+	const char* newPath = newFile;
+#endif
+	safe_call(oldReader.Open(oldPath));
+	safe_call(newReader.Open(newPath));
+	if (oldReader.IsIvfc() || newReader.IsIvfc())
+		die("Only plain RomFS images can be diffed");
+
+	delta_ctx_t ctx;
+	ctx.oldImg = oldReader.Image();
+	ctx.newImg = newReader.Image();
+	ctx.oldSize = oldReader.ImageSize();
+	ctx.newSize = newReader.ImageSize();
+
+	std::vector<delta_file_t> oldFiles, newFiles;
+	safe_call(listFiles(oldReader, oldFiles));
+	safe_call(listFiles(newReader, newFiles));
+
+	std::map<std::string, size_t> oldByPath;
+	for (size_t i = 0; i < oldFiles.size(); i ++)
+		oldByPath[oldFiles[i].path] = i;
+
+	// Files still at the same path with the same contents are settled right
+	// away, only the others are worth hashing
+	std::vector<u64> hints(newFiles.size(), DELTA_NO_HINT);
+	std::vector<bool> settled(newFiles.size(), false);
+	std::set<u64> unmatchedSizes;
+	for (size_t i = 0; i < newFiles.size(); i ++)
+	{
+		const delta_file_t& file = newFiles[i];
+		std::map<std::string, size_t>::iterator it = oldByPath.find(file.path);
+		if (it != oldByPath.end())
+		{
+			const delta_file_t& old = oldFiles[it->second];
+			hints[i] = old.offset;
+			settled[i] = old.size == file.size && memcmp(ctx.oldImg + old.offset, ctx.newImg + file.offset, file.size) == 0;
+		}
+		if (!settled[i] && file.size)
+			unmatchedSizes.insert(file.size);
+	}
+
+	std::map<std::string, u64> oldByHash;
+	for (size_t i = 0; i < oldFiles.size(); i ++)
+		if (unmatchedSizes.count(oldFiles[i].size))
+			oldByHash[hashKey(ctx.oldImg + oldFiles[i].offset, oldFiles[i].size)] = oldFiles[i].offset;
+
+	u32 moved = 0;
+	for (size_t i = 0; i < newFiles.size(); i ++)
+	{
+		const delta_file_t& file = newFiles[i];
+		if (settled[i] || !file.size) continue;
+		std::map<std::string, u64>::iterator it = oldByHash.find(hashKey(ctx.newImg + file.offset, file.size));
+		if (it != oldByHash.end())
+		{
+			hints[i] = it->second;
+			moved ++;
+		}
+	}
+
+	// Walk the new image front to back: metadata, then every file in data
+	// order with the padding between them. Deduplicated files share their
+	// data and only get described once.
+	std::vector<size_t> order(newFiles.size());
+	for (size_t i = 0; i < order.size(); i ++)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), file_order_t(newFiles));
+
+	u64 pos = newReader.DataOffset();
+	addRange(ctx, 0, pos, DELTA_NO_HINT);
+	for (size_t k = 0; k < order.size(); k ++)
+	{
+		const delta_file_t& file = newFiles[order[k]];
+		u64 end = file.offset + file.size;
+		if (end <= pos) continue;
+		if (file.offset > pos)
+			addRange(ctx, pos, file.offset - pos, DELTA_NO_HINT);
+		u64 skip = file.offset < pos ? pos - file.offset : 0;
+		u64 hint = hints[order[k]];
+		addRange(ctx, file.offset + skip, file.size - skip, hint != DELTA_NO_HINT ? hint + skip : hint);
+		pos = end;
+	}
+	if (ctx.newSize > pos)
+		addRange(ctx, pos, ctx.newSize - pos, DELTA_NO_HINT);
+
+	// Write out the patch
+	u8 header[DELTA_HEADER_SIZE];
+	u8* p = header;
+	memcpy(p, DELTA_MAGIC, 4);
+	p = putWord(p + 4, DELTA_VERSION);
+	p = putDword(p, ctx.oldSize);
+	p = putDword(p, ctx.newSize);
+	sha256(ctx.oldImg, oldReader.DataOffset(), p);
+	sha256(ctx.newImg, newReader.DataOffset(), p + SHA256_HASH_SIZE);
+	p += SHA256_HASH_SIZE*2;
+	p = putWord(p, (u32)oldReader.DataOffset());
+	p = putWord(p, (u32)newReader.DataOffset());
+	putDword(p, ctx.ops.size());
+
+	FILE* f = fopen(patchFile, "wb");
+	if (!f) die("Cannot create patch file");
+	bool rc = fwrite(header, 1, sizeof(header), f) == sizeof(header);
+	u64 stats[3] = { 0, 0, 0 }, inPlace = 0;
+	for (size_t i = 0; rc && i < ctx.ops.size(); i ++)
+	{
+		const delta_op_t& op = ctx.ops[i];
+		u8 buf[DELTA_OP_SIZE] = { 0 };
+		p = putWord(buf, op.type);
+		p = putWord(p, 0);
+		p = putDword(p, op.dst);
+		p = putDword(p, op.len);
+		p = putDword(p, op.src);
+		if (op.type != DELTA_ZERO)
+			sha256(ctx.newImg + op.dst, op.len, p);
+		rc = fwrite(buf, 1, sizeof(buf), f) == sizeof(buf);
+		stats[op.type] += op.len;
+		if (op.type == DELTA_COPY && op.src == op.dst)
+			inPlace += op.len;
+	}
+	for (size_t i = 0; rc && i < ctx.ops.size(); i ++)
+		if (ctx.ops[i].type == DELTA_DATA)
+			rc = fwrite(ctx.newImg + ctx.ops[i].dst, 1, ctx.ops[i].len, f) == ctx.ops[i].len;
+	if (fclose(f) != 0) rc = false;
+	if (!rc) die("Could not write patch file");
+
+	printf("Patch holds %u ops: %llu bytes kept in place, %llu bytes moved, %llu bytes of new data, %llu bytes of padding\n",
+		(u32)ctx.ops.size(), (unsigned long long)inPlace, (unsigned long long)(stats[DELTA_COPY] - inPlace),
+		(unsigned long long)stats[DELTA_DATA], (unsigned long long)stats[DELTA_ZERO]);
+	if (moved)
+		printf("  %u files were found at a different path or offset by their contents\n", moved);
+	return 0;
+}
+
+#define COPY_BUF_SIZE 0x100000
+
+// Copies len bytes between streams, from wherever they are positioned
+static bool copyStream(FILE* in, FILE* out, u64 len, std::vector<u8>& buf)
+{
+	while (len)
+	{
+		size_t size = len < buf.size() ? (size_t)len : buf.size();
+		if (fread(&buf.front(), 1, size, in) != size || fwrite(&buf.front(), 1, size, out) != size)
+			return false;
+		len -= size;
+	}
+	return true;
+}
+
+static bool writeZeros(FILE* out, u64 len, std::vector<u8>& buf)
+{
+	memset(&buf.front(), 0, buf.size());
+	while (len)
+	{
+		size_t size = len < buf.size() ? (size_t)len : buf.size();
+		if (fwrite(&buf.front(), 1, size, out) != size)
+			return false;
+		len -= size;
+	}
+	return true;
+}
+
+// Hashes the next size bytes of a stream
+static bool hashRange(FILE* f, u64 size, u8* hash, std::vector<u8>& buf)
+{
+	sha256_ctx ctx;
+	sha256_init(&ctx);
+	while (size)
+	{
+		size_t count = size < buf.size() ? (size_t)size : buf.size();
+		if (fread(&buf.front(), 1, count, f) != count) return false;
+		sha256_update(&ctx, &buf.front(), count);
+		size -= count;
+	}
+	sha256_final(&ctx, hash);
+	return true;
+}
+
+// Hashes the first size bytes of a stream
+static bool hashStream(FILE* f, u64 size, u8* hash, std::vector<u8>& buf)
+{
+	return fseek64(f, 0, SEEK_SET) == 0 && hashRange(f, size, hash, buf);
+}
+
+// Checks what the ops copy from the old image or take from the patch
+// against the hashes the patch recorded, before anything gets written.
+// Ranges an in place apply leaves alone are only checked if all is set.
+// Leaves the patch positioned at the start of its data again.
+static int verifyOps(FILE* img, FILE* patch, const std::vector<delta_op_t>& ops, bool all, std::vector<u8>& buf)
+{
+	s64 dataStart = ftell64(patch);
+	u8 hash[SHA256_HASH_SIZE];
+	bool oldOk = true, patchOk = dataStart >= 0;
+	for (size_t i = 0; oldOk && patchOk && i < ops.size(); i ++)
+	{
+		const delta_op_t& op = ops[i];
+		if (op.type == DELTA_COPY && (all || op.src != op.dst))
+			oldOk = fseek64(img, op.src, SEEK_SET) == 0 && hashRange(img, op.len, hash, buf)
+				&& memcmp(hash, op.hash, SHA256_HASH_SIZE) == 0;
+		else if (op.type == DELTA_DATA)
+			patchOk = hashRange(patch, op.len, hash, buf) && memcmp(hash, op.hash, SHA256_HASH_SIZE) == 0;
+	}
+	if (!oldOk) die("The patch was made for a different image");
+	if (!patchOk || fseek64(patch, dataStart, SEEK_SET) != 0) die("The patch is corrupted");
+	return 0;
+}
+
+static int applyOps(FILE* img, FILE* patch, FILE* out, const std::vector<delta_op_t>& ops, bool inPlace, std::vector<u8>& buf)
+{
+	// In place, everything that moves is read before anything is written,
+	// as its source may well be overwritten by an earlier op
+	FILE* spool = NULL;
+	if (inPlace)
+	{
+		for (size_t i = 0; i < ops.size(); i ++)
+		{
+			if (ops[i].type != DELTA_COPY || ops[i].src == ops[i].dst) continue;
+			if (!spool && !(spool = tmpfile())) die("Cannot create temporary file");
+			if (fseek64(img, ops[i].src, SEEK_SET) != 0 || !copyStream(img, spool, ops[i].len, buf))
+			{
+				fclose(spool);
+				die("Could not read old image");
+			}
+		}
+		if (spool) rewind(spool);
+	}
+
+	bool rc = true;
+	for (size_t i = 0; rc && i < ops.size(); i ++)
+	{
+		const delta_op_t& op = ops[i];
+		if (inPlace && op.type == DELTA_COPY && op.src == op.dst)
+			continue; // Already there
+		rc = fseek64(out, op.dst, SEEK_SET) == 0;
+		if (!rc) break;
+
+		switch (op.type)
+		{
+			case DELTA_COPY:
+				if (inPlace)
+					rc = copyStream(spool, out, op.len, buf);
+				else
+					rc = fseek64(img, op.src, SEEK_SET) == 0 && copyStream(img, out, op.len, buf);
+				break;
+			case DELTA_DATA:
+				rc = copyStream(patch, out, op.len, buf);
+				break;
+			default:
+				rc = writeZeros(out, op.len, buf);
+				break;
+		}
+	}
+	if (spool) fclose(spool);
+	if (!rc) die("Could not apply patch");
+	return 0;
+}
+
+static int apply(const char* oldFile, const char* patchFile, const char* newFile, bool verify)
+{
+	FILE* patch = fopen(patchFile, "rb");
+	if (!patch) die("Cannot open patch file");
+	u8 header[DELTA_HEADER_SIZE];
+	bool valid = fread(header, 1, sizeof(header), patch) == sizeof(header) &&
+		memcmp(header, DELTA_MAGIC, 4) == 0 && getWord(header + 4) == DELTA_VERSION;
+	u64 oldSize = getDword(header + 8), newSize = getDword(header + 0x10);
+	u32 oldMetaSize = getWord(header + 0x58), newMetaSize = getWord(header + 0x5C);
+	u64 opCount = getDword(header + 0x60);
+
+	// Every op has to stay within the images, and together they have to
+	// describe the new image from front to back
+	std::vector<delta_op_t> ops;
+	u64 pos = 0, dataSize = 0;
+	for (u64 i = 0; valid && i < opCount; i ++)
+	{
+		u8 buf[DELTA_OP_SIZE];
+		delta_op_t op;
+		valid = fread(buf, 1, sizeof(buf), patch) == sizeof(buf);
+		op.type = getWord(buf);
+		op.dst = getDword(buf + 8);
+		op.len = getDword(buf + 16);
+		op.src = getDword(buf + 24);
+		memcpy(op.hash, buf + 32, SHA256_HASH_SIZE);
+		valid = valid && op.type <= DELTA_ZERO && op.dst == pos && op.len <= newSize - pos;
+		valid = valid && (op.type != DELTA_COPY || (op.src <= oldSize && op.len <= oldSize - op.src));
+		if (op.type == DELTA_DATA) dataSize += op.len;
+		pos += op.len;
+		ops.push_back(op);
+	}
+	if (!valid || pos != newSize)
+	{
+		fclose(patch);
+		die("Not a valid RomFS patch");
+	}
+
+	bool inPlace = newFile == NULL;
+	FILE* img = fopen(oldFile, inPlace ? "r+b" : "rb");
+	if (!img)
+	{
+		fclose(patch);
+		die("Cannot open old image");
+	}
+
+	// The metadata is checked first as it tells a different image apart
+	// right away, the data the patch reads gets checked op by op below
+	std::vector<u8> buf(COPY_BUF_SIZE);
+	u8 hash[SHA256_HASH_SIZE];
+	int rc = 0;
+	if (fseek64(img, 0, SEEK_END) != 0 || (u64)ftell64(img) != oldSize ||
+		!hashStream(img, oldMetaSize, hash, buf) || memcmp(hash, header + 0x18, SHA256_HASH_SIZE) != 0)
+	{
+		fputs("The patch was made for a different image\n\n", stderr);
+		rc = 1;
+	}
+
+	if (rc == 0)
+		rc = verifyOps(img, patch, ops, verify || !inPlace, buf);
+
+	FILE* out = img;
+	if (rc == 0 && !inPlace && !(out = fopen(newFile, "wb")))
+	{
+		fputs("Cannot create output image\n\n", stderr);
+		rc = 1;
+	}
+
+	if (rc == 0)
+		rc = applyOps(img, patch, out, ops, inPlace, buf);
+	if (rc == 0 && inPlace && newSize < oldSize)
+	{
+		fflush(img);
+#ifdef WIN32
+		if (_chsize_s(_fileno(img), newSize) != 0)
+#else
+		if (ftruncate(fileno(img), newSize) != 0)
+#endif
+		{
+			fputs("Could not truncate image\n\n", stderr);
+			rc = 1;
+		}
+	}
+
+	// Reading back the metadata catches patches applied to the wrong image
+	// as well as most broken ones
+	if (rc == 0)
+	{
+		FILE* check = inPlace ? img : freopen(newFile, "rb", out);
+		out = check;
+		if (!check || !hashStream(check, newMetaSize, hash, buf) || memcmp(hash, header + 0x38, SHA256_HASH_SIZE) != 0)
+		{
+			fputs("The patched image does not match\n\n", stderr);
+			rc = 1;
+		}
+	}
+
+	if (out && out != img) fclose(out);
+	fclose(img);
+	fclose(patch);
+	if (rc == 0)
+		printf("Applied %u ops, %llu bytes of new data\n", (u32)ops.size(), (unsigned long long)dataSize);
+	return rc;
+}
+
+int main(int argc, char* argv[])
+{
+	argInfo args;
+	safe_call(parseArgs(args, argc, argv));
+
+	if (args.apply)
+		return apply(args.oldFile, args.patchFile, args.newFile, args.verify);
+	return diff(args.oldFile, args.newFile, args.patchFile);
+}
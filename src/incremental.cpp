@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <map>
+#include <string>
+#include "types.h"
+#include "FileClass.h"
+#include "romfs.h"
+#include "sha256.h"
+#include "zerocopy.h"
+
+#define die(msg) do { fputs(msg "\n\n", stderr); return 1; } while(0)
+#define safe_call(a) do { int rc = a; if(rc != 0) return rc; } while(0)
+
+// The sidecar manifest (<output>.manifest) remembers what went into the
+// image, one record per line:
+//   mkromfs3ds-manifest 2
+//   image <size> <mtime> <data offset> <dir buckets> <file buckets>
+//   D <path>
+//   F <size> <mtime> <inode> <data offset> <sha256> <path>
+// Records appear in the same order as the entries of the image and paths are
+// the UTF-8 paths inside the image, with backslashes and newlines escaped.
+#define MANIFEST_MAGIC "mkromfs3ds-manifest 2"
+
+#define COPY_BUF_SIZE 0x100000
+
+struct manifest_file_t
+{
+	u64 size, mtime, inode, dataOff;
+	u8 hash[SHA256_HASH_SIZE];
+};
+
+struct manifest_t
+{
+	u64 imageSize, imageTime, dataStart;
+	u64 dirBuckets, fileBuckets;
+	std::vector<std::string> dirPaths, filePaths;
+	std::vector<manifest_file_t> files;
+};
+
+static bool statImage(const char* path, u64& size, u64& mtime)
+{
+	struct stat statbuf;
+	if (stat(path, &statbuf) < 0) return false;
+	size = statbuf.st_size;
+#if defined(WIN32)
+	mtime = statbuf.st_mtime;
+#elif defined(__APPLE__)
+	mtime = (u64)statbuf.st_mtimespec.tv_sec*1000000000 + statbuf.st_mtimespec.tv_nsec;
+#else
+	mtime = (u64)statbuf.st_mtim.tv_sec*1000000000 + statbuf.st_mtim.tv_nsec;
+#endif
+	return true;
+}
+
+static bool replaceFile(const char* from, const char* to)
+{
+#ifdef WIN32
+	remove(to);
+#endif
+	return rename(from, to) == 0;
+}
+
+static void escapePath(std::string& out, const std::string& path)
+{
+	for (size_t i = 0; i < path.size(); i ++)
+	{
+		if (path[i] == '\\') out += "\\\\";
+		else if (path[i] == '\n') out += "\\n";
+		else out += path[i];
+	}
+}
+
+static std::string unescapePath(const char* str)
+{
+	std::string out;
+	for (; *str; str ++)
+	{
+		if (*str == '\\' && str[1])
+			out += *++str == 'n' ? '\n' : *str;
+		else
+			out += *str;
+	}
+	return out;
+}
+
+static bool readLine(FILE* f, std::string& line)
+{
+	char buf[4096];
+	line.clear();
+	while (fgets(buf, sizeof(buf), f))
+	{
+		line += buf;
+		if (line[line.size()-1] == '\n')
+		{
+			line.erase(line.size()-1);
+			return true;
+		}
+	}
+	return !line.empty();
+}
+
+static bool parseU64(const char*& str, u64& out)
+{
+	char* end;
+	out = strtoull(str, &end, 10);
+	if (end == str || *end != ' ') return false;
+	str = end + 1;
+	return true;
+}
+
+static bool parseHash(const char*& str, u8* hash)
+{
+	for (int i = 0; i < SHA256_HASH_SIZE; i ++)
+	{
+		unsigned int byte;
+		if (sscanf(str + i*2, "%2x", &byte) != 1) return false;
+		hash[i] = byte;
+	}
+	str += SHA256_HASH_SIZE*2;
+	return *str++ == ' ';
+}
+
+// Returns false if there is no usable manifest for the image
+static bool loadManifest(const char* path, const char* imagePath, manifest_t& m)
+{
+	FILE* f = fopen(path, "r");
+	if (!f) return false;
+
+	std::string line;
+	bool ok = readLine(f, line) && line == MANIFEST_MAGIC;
+	ok = ok && readLine(f, line) && sscanf(line.c_str(), "image %llu %llu %llu %llu %llu",
+		(unsigned long long*)&m.imageSize, (unsigned long long*)&m.imageTime, (unsigned long long*)&m.dataStart,
+		(unsigned long long*)&m.dirBuckets, (unsigned long long*)&m.fileBuckets) == 5;
+
+	while (ok && readLine(f, line))
+	{
+		const char* str = line.c_str();
+		if (str[0] == 'D' && str[1] == ' ')
+			m.dirPaths.push_back(unescapePath(str + 2));
+		else if (str[0] == 'F' && str[1] == ' ')
+		{
+			manifest_file_t file;
+			str += 2;
+			ok = parseU64(str, file.size) && parseU64(str, file.mtime) && parseU64(str, file.inode)
+				&& parseU64(str, file.dataOff) && parseHash(str, file.hash);
+			m.files.push_back(file);
+			m.filePaths.push_back(unescapePath(str));
+		} else
+			ok = false;
+	}
+	fclose(f);
+
+	// The image must still be the one the manifest describes
+	u64 size, mtime;
+	return ok && statImage(imagePath, size, mtime) && size == m.imageSize && mtime == m.imageTime;
+}
+
+static int saveManifest(const char* path, const char* imagePath, u64 dataStart, u32 dirBuckets, u32 fileBuckets,
+	const std::vector<std::string>& dirPaths, const std::vector<std::string>& filePaths,
+	const std::vector<romfs_file_t>& files, const std::vector<romfs_host_t>& hosts, const std::vector<u8>& hashes)
+{
+	u64 size, mtime;
+	if (!statImage(imagePath, size, mtime)) die("Cannot stat output file");
+
+	std::string tmpPath = std::string(path) + ".tmp";
+	FILE* f = fopen(tmpPath.c_str(), "w");
+	if (!f) die("Cannot create manifest file");
+
+	fprintf(f, MANIFEST_MAGIC "\nimage %llu %llu %llu %u %u\n", (unsigned long long)size, (unsigned long long)mtime, (unsigned long long)dataStart,
+		(unsigned)dirBuckets, (unsigned)fileBuckets);
+
+	std::string line;
+	for (size_t i = 0; i < dirPaths.size(); i ++)
+	{
+		line = "D ";
+		escapePath(line, dirPaths[i]);
+		fprintf(f, "%s\n", line.c_str());
+	}
+
+	for (size_t i = 0; i < files.size(); i ++)
+	{
+		char hex[SHA256_HASH_SIZE*2+1];
+		for (int j = 0; j < SHA256_HASH_SIZE; j ++)
+			sprintf(hex + j*2, "%02x", hashes[i*SHA256_HASH_SIZE + j]);
+		line = "";
+		escapePath(line, filePaths[i]);
+		fprintf(f, "F %llu %llu %llu %llu %s %s\n", (unsigned long long)files[i].dataSize, (unsigned long long)hosts[i].mtime,
+			(unsigned long long)hosts[i].inode, (unsigned long long)files[i].dataOff, hex, line.c_str());
+	}
+
+	bool rc = fflush(f) == 0 && !ferror(f);
+	fclose(f);
+	if (!rc || !replaceFile(tmpPath.c_str(), path))
+	{
+		remove(tmpPath.c_str());
+		die("Cannot write manifest file");
+	}
+	return 0;
+}
+
+// Overwrites the data of a single file inside an existing image
+static int patchFile(FILE* img, u64 offset, const oschar_t* path, u64 hostOff, u64 dataSize, std::vector<u8>& buf, bool sparse)
+{
+	fflush(img);
+	int outFd = zeroCopyTarget(img);
+	if (outFd >= 0)
+	{
+		// The old data goes first, so that holes of the input stay holes
+		bool holes = sparse && punchHole(outFd, offset, dataSize) == 0;
+		int rc = zeroCopyFile(outFd, offset, path, hostOff, dataSize, 0, holes);
+		if (rc >= 0) return rc;
+	}
+
+	FILE* f = osfopen(path, "rb");
+	bool rc = f != NULL && fseek64(img, offset, SEEK_SET) == 0;
+	if (rc && hostOff)
+		rc = fseek64(f, hostOff, SEEK_SET) == 0;
+	for (u64 remaining = dataSize; rc && remaining; )
+	{
+		size_t size = remaining < buf.size() ? (size_t)remaining : buf.size();
+		rc = fread(&buf.front(), 1, size, f) == size && fwrite(&buf.front(), 1, size, img) == size;
+		remaining -= size;
+	}
+	if (f) fclose(f);
+
+	if (!rc) die("Could not patch output file");
+	return 0;
+}
+
+// Builds outPath, reusing as much as possible of the image a previous build
+// left there. If the tree has the same shape (same entries in the same order
+// with the same sizes) every offset is unchanged and only the data of the
+// modified files is rewritten in place. Otherwise a new image is written, but
+// the data of unmodified files is copied over from the old one.
+int RomFS::WriteIncremental(const char* outPath)
+{
+	std::string manifestPath = std::string(outPath) + ".manifest";
+
+	std::vector<std::string> dirPaths, filePaths;
+	GetPaths(dirPaths, filePaths);
+
+	manifest_t old;
+	bool haveOld = loadManifest(manifestPath.c_str(), outPath, old);
+
+	bool sameShape = haveOld && old.dirPaths == dirPaths && old.filePaths == filePaths
+		&& old.dataStart == DataStart()
+		&& old.dirBuckets == dirHashCount && old.fileBuckets == fileHashCount;
+
+	for (size_t i = 0; sameShape && i < files.size(); i ++)
+		sameShape = old.files[i].size == files[i].dataSize && old.files[i].dataOff == files[i].dataOff;
+
+	std::map<std::string, size_t> oldIndex;
+	if (haveOld && !sameShape)
+		for (size_t i = 0; i < old.filePaths.size(); i ++)
+			oldIndex[old.filePaths[i]] = i;
+
+	// Files whose size, mtime and inode match the manifest are trusted to be
+	// unchanged, everything else gets hashed. File list entries that came
+	// with a size were never looked at, so there is nothing to compare.
+	std::vector<u8> hashes(files.size() * SHA256_HASH_SIZE);
+	std::vector<const manifest_file_t*> prevs(files.size(), (const manifest_file_t*)NULL);
+	std::vector<u32> toHash;
+
+	for (u32 i = 0; i < files.size(); i ++)
+	{
+		romfs_file_t& file = files[i];
+		const manifest_file_t* prev = NULL;
+		if (sameShape)
+			prev = &old.files[i];
+		else if (haveOld)
+		{
+			std::map<std::string, size_t>::iterator found = oldIndex.find(filePaths[i]);
+			if (found != oldIndex.end() && old.files[found->second].size == file.dataSize)
+				prev = &old.files[found->second];
+		}
+		prevs[i] = prev;
+
+		if (prev && (hosts[i].mtime || hosts[i].inode) && prev->mtime == hosts[i].mtime && prev->inode == hosts[i].inode)
+		{
+			memcpy(&hashes[i*SHA256_HASH_SIZE], prev->hash, SHA256_HASH_SIZE);
+			continue;
+		}
+
+		toHash.push_back(i);
+	}
+
+	std::vector<u8> newHashes(toHash.size() * SHA256_HASH_SIZE);
+	safe_call(HashFiles(toHash, newHashes.empty() ? NULL : &newHashes.front()));
+	for (size_t j = 0; j < toHash.size(); j ++)
+		memcpy(&hashes[toHash[j]*SHA256_HASH_SIZE], &newHashes[j*SHA256_HASH_SIZE], SHA256_HASH_SIZE);
+
+	// Touched but identical files count as unchanged too
+	std::vector<bool> unchanged(files.size(), false);
+	for (size_t i = 0; i < files.size(); i ++)
+		unchanged[i] = prevs[i] && memcmp(&hashes[i*SHA256_HASH_SIZE], prevs[i]->hash, SHA256_HASH_SIZE) == 0;
+
+	if (sameShape)
+	{
+		// A crash half way through must not leave a manifest that vouches for a stale image
+		remove(manifestPath.c_str());
+
+		FILE* img = fopen(outPath, "r+b");
+		if (!img) die("Cannot open output file");
+
+		std::vector<u8> buf(CopyBufSize(1));
+		u32 patched = 0;
+		int rc = 0;
+		for (u32 i = 0; rc == 0 && i < files.size(); i ++)
+		{
+			if (unchanged[i] || files[i].dataOwner != ROMFS_NONE)
+				continue; // Shared data gets patched through the file that owns it
+			rc = patchFile(img, old.dataStart + files[i].dataOff, HostPath(i), hosts[i].hostOff, files[i].dataSize, buf, opts.sparse);
+			patched ++;
+		}
+		if (fclose(img) != 0 && rc == 0) die("Could not write output file");
+		if (rc) return rc;
+
+		printf("Patched %u of %u files in place\n", patched, (u32)files.size());
+	} else
+	{
+		// Unchanged data is read back from the old image while the new one goes
+		// to a temporary file, which then replaces it
+		u32 reused = 0;
+		if (haveOld)
+		{
+#ifdef WIN32
+			WCHAR buf[OSPATHLEN];
+			if (!MultiByteToWideChar(CP_ACP, 0, outPath, -1, buf, OSPATHLEN))
+				die("Cannot convert to Unicode");
+			size_t outPathOff = AddHostPath(buf, NULL);
+#else
+			size_t outPathOff = AddHostPath(outPath, NULL);
+#endif
+			for (size_t i = 0; i < files.size(); i ++)
+			{
+				if (!unchanged[i]) continue;
+				hosts[i].pathOff = outPathOff;
+				hosts[i].hostOff = old.dataStart + prevs[i]->dataOff;
+				reused ++;
+			}
+		}
+
+		std::string tmpPath = std::string(outPath) + ".tmp";
+		int rc;
+		{
+			FileClass fout(tmpPath.c_str(), "wb");
+			if (fout.openerror()) die("Cannot open output file");
+			rc = WriteToFile(fout);
+			fout.Flush();
+			if (rc == 0 && ferror(fout.get_ptr())) rc = 1;
+		}
+		if (rc != 0 || !replaceFile(tmpPath.c_str(), outPath))
+		{
+			remove(tmpPath.c_str());
+			die("Could not write output file");
+		}
+
+		printf("Rebuilt image, reused data of %u of %u files\n", reused, (u32)files.size());
+	}
+
+	return saveManifest(manifestPath.c_str(), outPath, DataStart(), dirHashCount, fileHashCount, dirPaths, filePaths, files, hosts, hashes);
+}
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ivfc.h"
+#include "sha256.h"
+
+#define die(msg) do { fputs(msg "\n\n", stderr); return 1; } while(0)
+
+static inline u64 alignBlock(u64 x)
+{
+	return (x + IVFC_BLOCK_SIZE - 1) &~ (u64)(IVFC_BLOCK_SIZE - 1);
+}
+
+// Size of the level holding one hash per block of a level of size bytes
+static inline u64 hashLevelSize(u64 size)
+{
+	return alignBlock(size) / IVFC_BLOCK_SIZE * SHA256_HASH_SIZE;
+}
+
+// Hashes consecutive blocks, the last one is zero padded if incomplete
+static void hashBlocks(const u8* data, u64 size, u8* out)
+{
+	u8 last[IVFC_BLOCK_SIZE];
+	for (; size; size -= size < IVFC_BLOCK_SIZE ? size : IVFC_BLOCK_SIZE)
+	{
+		if (size < IVFC_BLOCK_SIZE)
+		{
+			memcpy(last, data, size);
+			memset(last + size, 0, IVFC_BLOCK_SIZE - size);
+			data = last;
+		}
+		sha256(data, IVFC_BLOCK_SIZE, out);
+		data += IVFC_BLOCK_SIZE;
+		out += SHA256_HASH_SIZE;
+	}
+}
+
+struct ivfc_task_t
+{
+	const u8* data;
+	u64 size;
+	u8* out;
+};
+
+static void hashTask(void* arg)
+{
+	ivfc_task_t* task = (ivfc_task_t*)arg;
+	hashBlocks(task->data, task->size, task->out);
+	delete task;
+}
+
+IvfcWriter::IvfcWriter(u64 imageSize, ThreadPool& pool, size_t batchSize) :
+	level3Size(imageSize), pool(pool), group(), level2(), batchSize(batchSize), fill(0), current(0), blocksQueued(0), start(0)
+{
+	level2Size = hashLevelSize(level3Size);
+	level1Size = hashLevelSize(level2Size);
+	masterSize = (u32)hashLevelSize(level1Size);
+
+	level2.resize(level2Size);
+	batches[0] = (u8*)malloc(batchSize);
+	batches[1] = (u8*)malloc(batchSize);
+}
+
+IvfcWriter::~IvfcWriter()
+{
+	pool.Wait(&group);
+	free(batches[0]);
+	free(batches[1]);
+}
+
+u32 IvfcWriter::Level3Offset() const
+{
+	return (u32)alignBlock(0x60 + masterSize);
+}
+
+static inline u8* putWord(u8* p, u32 value)
+{
+	value = le_word(value);
+	memcpy(p, &value, 4);
+	return p + 4;
+}
+
+static inline u8* putDword(u8* p, u64 value)
+{
+	value = le_dword(value);
+	memcpy(p, &value, 8);
+	return p + 8;
+}
+
+int IvfcWriter::Begin(FileClass& f)
+{
+	if (!batches[0] || !batches[1]) die("Out of memory!");
+	f.Flush();
+	if (ftell64(f.get_ptr()) < 0) die("IVFC output has to be seekable");
+	start = f.Tell();
+
+	// Logical offsets place the levels back to back in order, block aligned
+	u64 level2Off = alignBlock(level1Size);
+	u64 level3Off = alignBlock(level2Off + level2Size);
+
+	// Magic, version, master hash size, then offset, size and block size of
+	// each level, a reserved word and the header size at 0x58
+	std::vector<u8> header(Level3Offset(), 0);
+	u8* p = &header.front();
+	memcpy(p, "IVFC", 4);
+	p = putWord(p + 4, 0x10000);
+	p = putWord(p, masterSize);
+	p = putDword(p, 0);
+	p = putDword(p, level1Size);
+	p = putWord(p, IVFC_BLOCK_LOG2);
+	p = putWord(p, 0);
+	p = putDword(p, level2Off);
+	p = putDword(p, level2Size);
+	p = putWord(p, IVFC_BLOCK_LOG2);
+	p = putWord(p, 0);
+	p = putDword(p, level3Off);
+	p = putDword(p, level3Size);
+	p = putWord(p, IVFC_BLOCK_LOG2);
+	p = putWord(p, 0);
+	p = putWord(p, 0);
+	putWord(p, IVFC_HEADER_SIZE);
+
+	if (!f.WriteRaw(&header.front(), header.size())) die("Could not write output file");
+	return 0;
+}
+
+// Hands the collected batch to the pool, after making sure the other one is
+// done so that it can be refilled
+void IvfcWriter::Submit(void)
+{
+	pool.Wait(&group);
+	if (!fill) return;
+
+	u64 blocks = alignBlock(fill) / IVFC_BLOCK_SIZE;
+	u64 perTask = (blocks + pool.NumThreads() - 1) / pool.NumThreads();
+	for (u64 first = 0; first < blocks; first += perTask)
+	{
+		ivfc_task_t* task = new ivfc_task_t;
+		task->data = batches[current] + first*IVFC_BLOCK_SIZE;
+		task->size = (first + perTask < blocks ? perTask*IVFC_BLOCK_SIZE : fill - first*IVFC_BLOCK_SIZE);
+		task->out = &level2[(blocksQueued + first) * SHA256_HASH_SIZE];
+		pool.Submit(hashTask, task, &group);
+	}
+
+	blocksQueued += blocks;
+	current ^= 1;
+	fill = 0;
+}
+
+void IvfcWriter::Update(const void* data, size_t size)
+{
+	const u8* in = (const u8*)data;
+	while (size)
+	{
+		size_t count = batchSize - fill;
+		if (count > size) count = size;
+		memcpy(batches[current] + fill, in, count);
+		fill += count;
+		in += count;
+		size -= count;
+		if (fill == batchSize)
+			Submit();
+	}
+}
+
+int IvfcWriter::Finish(FileClass& f)
+{
+	Submit();
+	pool.Wait(&group);
+	if (blocksQueued * SHA256_HASH_SIZE != level2Size) die("IVFC level 3 size mismatch");
+
+	// The upper levels are tiny in comparison, they are hashed right here
+	std::vector<u8> level1(level1Size), master(masterSize);
+	hashBlocks(&level2.front(), level2Size, &level1.front());
+	hashBlocks(&level1.front(), level1Size, &master.front());
+
+	static const u8 zeros[IVFC_BLOCK_SIZE] = { 0 };
+	u64 level3End = Level3Offset() + level3Size;
+	bool rc = f.WriteRaw(zeros, alignBlock(level3End) - level3End);
+	rc = rc && f.WriteRaw(&level1.front(), level1Size) && f.WriteRaw(zeros, alignBlock(level1Size) - level1Size);
+	rc = rc && f.WriteRaw(&level2.front(), level2Size) && f.WriteRaw(zeros, alignBlock(level2Size) - level2Size);
+	if (!rc) die("Could not write output file");
+
+	s64 end = f.Tell();
+	f.Seek(start + 0x60, SEEK_SET);
+	rc = f.WriteRaw(&master.front(), masterSize);
+	f.Seek(end, SEEK_SET);
+	if (!rc) die("Could not write output file");
+
+	printf("Added IVFC hash tree, level 3 at 0x%X, %u bytes of hashes\n", Level3Offset(),
+		(u32)(masterSize + level1Size + level2Size));
+	return 0;
+}
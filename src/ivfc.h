@@ -0,0 +1,52 @@
+#pragma once
+#include <vector>
+#include "types.h"
+#include "FileClass.h"
+#include "threadpool.h"
+
+#define IVFC_BLOCK_LOG2 12
+#define IVFC_BLOCK_SIZE (1 << IVFC_BLOCK_LOG2)
+#define IVFC_HEADER_SIZE 0x5C
+#define IVFC_BATCH 0x400000 // Default bytes of level 3 hashed per round of tasks
+
+// Wraps an image in the IVFC hash tree NCCH containers expect around their
+// RomFS. The image becomes level 3; level 2 holds the SHA-256 of each of
+// its blocks, level 1 those of level 2 and the master hash those of level
+// 1. The output is laid out as header, master hash, level 3, level 1 and
+// level 2, each starting on a block boundary.
+//
+// The image is fed in as it is written. Full batches of blocks are hashed
+// on a thread pool while the next batch is being collected, so the image
+// never has to be read back. The master hash depends on everything else
+// and gets filled in last, which needs a seekable output.
+class IvfcWriter
+{
+	u64 level3Size, level2Size, level1Size;
+	u32 masterSize;
+
+	ThreadPool& pool;
+	TaskGroup group;
+	std::vector<u8> level2; // Filled in while the image streams through
+	u8* batches[2];
+	size_t batchSize;
+	size_t fill;       // Bytes collected in the current batch
+	int current;       // Batch being collected, the other one may still be hashed
+	u64 blocksQueued;  // Level 3 blocks handed to the pool so far
+	s64 start;         // Output position of the header
+
+	void Submit(void);
+
+public:
+	IvfcWriter(u64 imageSize, ThreadPool& pool, size_t batchSize = IVFC_BATCH);
+	~IvfcWriter();
+
+	// Position of level 3 relative to the start of the output
+	u32 Level3Offset() const;
+
+	// Writes the header and leaves room for the master hash
+	int Begin(FileClass& f);
+	// Passes on image data that has just been written
+	void Update(const void* data, size_t size);
+	// Writes levels 1 and 2 after the image and fills in the master hash
+	int Finish(FileClass& f);
+};
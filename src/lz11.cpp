@@ -0,0 +1,314 @@
+#include <string.h>
+#include <ctype.h>
+#include "lz11.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define WINDOW 0x1000
+#define MIN_MATCH 3
+#define MAX_MATCH 0x10110
+#define HASH_BITS 15
+#define MAX_CHAIN 128 // Candidates tried per position
+#define LAZY_LIMIT 0x40 // Matches at least this long are taken right away
+#define NO_POS 0xFFFFFFFF
+
+// Length of the common prefix of a and b, up to max bytes. Compares 16
+// bytes per step where vector instructions are available, 8 otherwise.
+static inline u32 matchLength(const u8* a, const u8* b, u32 max)
+{
+	u32 len = 0;
+#if defined(__SSE2__)
+	for (; len + 16 <= max; len += 16)
+	{
+		__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + len)), _mm_loadu_si128((const __m128i*)(b + len)));
+		u32 diff = ~_mm_movemask_epi8(eq) & 0xFFFF;
+		if (diff) return len + __builtin_ctz(diff);
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	for (; len + 16 <= max; len += 16)
+	{
+		uint8x16_t eq = vceqq_u8(vld1q_u8(a + len), vld1q_u8(b + len));
+		// Narrow every byte of the comparison to 4 bits of a 64-bit mask
+		u64 diff = ~vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+		if (diff) return len + __builtin_ctzll(diff) / 4;
+	}
+#elif defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for (; len + 8 <= max; len += 8)
+	{
+		u64 x, y;
+		memcpy(&x, a + len, 8);
+		memcpy(&y, b + len, 8);
+		if (x != y) return len + __builtin_ctzll(x ^ y) / 8;
+	}
+#endif
+	for (; len < max && a[len] == b[len]; len ++) ;
+	return len;
+}
+
+static inline u32 hash3(const u8* p)
+{
+	return (((u32)p[0] << 16 | (u32)p[1] << 8 | p[2]) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+LZ11Encoder::LZ11Encoder(u64 size) :
+	size(size), window(), base(0), pos(0), head(1 << HASH_BITS, NO_POS), prev(WINDOW, NO_POS),
+	out(), drained(0), flagPos(0), count(0), len(0), disp(0), known(false)
+{
+	out.push_back(0x11);
+	if (size <= 0xFFFFFF && size)
+	{
+		out.push_back(size & 0xFF);
+		out.push_back((size >> 8) & 0xFF);
+		out.push_back((size >> 16) & 0xFF);
+	} else
+	{
+		// A zero size in the header means a 32-bit one follows
+		out.insert(out.end(), 3, 0);
+		for (int i = 0; i < 4; i ++)
+			out.push_back((size >> (i*8)) & 0xFF);
+	}
+}
+
+// prev only remembers the last window's worth of positions, which is all a
+// match can reach anyway
+void LZ11Encoder::Insert(u64 p)
+{
+	if (size - p < MIN_MATCH) return;
+	u32& h = head[hash3(At(p))];
+	prev[p & (WINDOW-1)] = h;
+	h = (u32)p;
+}
+
+u32 LZ11Encoder::Find(u64 p, u32& matchDisp) const
+{
+	if (size - p < MIN_MATCH) return 0;
+	u32 max = size - p < MAX_MATCH ? (u32)(size - p) : MAX_MATCH;
+	const u8* cur = At(p);
+	u32 best = 0;
+	int chain = MAX_CHAIN;
+	for (u32 cand = head[hash3(cur)]; cand != NO_POS && p - cand <= WINDOW && chain--; cand = prev[cand & (WINDOW-1)])
+	{
+		// Only worth a full comparison if it can beat the best so far
+		const u8* from = At(cand);
+		if (from[best] != cur[best]) continue;
+		u32 l = matchLength(from, cur, max);
+		if (l > best)
+		{
+			best = l;
+			matchDisp = (u32)(p - cand);
+			if (l == max) break;
+		}
+	}
+	return best >= MIN_MATCH ? best : 0;
+}
+
+// Groups tokens by eight behind their flag byte
+void LZ11Encoder::Token(bool match)
+{
+	if (!count)
+	{
+		flagPos = out.size();
+		out.push_back(0);
+	}
+	if (match) out[flagPos] |= 0x80 >> count;
+	count = (count + 1) & 7;
+}
+
+void LZ11Encoder::Literal(u8 c)
+{
+	Token(false);
+	out.push_back(c);
+}
+
+void LZ11Encoder::Match(u32 matchLen, u32 matchDisp)
+{
+	Token(true);
+	matchDisp --;
+	if (matchLen <= 0x10)
+		out.push_back((matchLen - 1) << 4 | matchDisp >> 8);
+	else if (matchLen <= 0x110)
+	{
+		matchLen -= 0x11;
+		out.push_back(matchLen >> 4);
+		out.push_back((matchLen & 0xF) << 4 | matchDisp >> 8);
+	} else
+	{
+		matchLen -= 0x111;
+		out.push_back(0x10 | matchLen >> 12);
+		out.push_back((matchLen >> 4) & 0xFF);
+		out.push_back((matchLen & 0xF) << 4 | matchDisp >> 8);
+	}
+	out.push_back(matchDisp & 0xFF);
+}
+
+// Encodes as far as the input allows. Until the end of the stream the
+// lookahead needs the longest match past the next position, so that the
+// output does not depend on how the input was split up.
+void LZ11Encoder::Encode(bool final)
+{
+	u64 end = base + window.size();
+	while (pos < size && (final || end - pos > MAX_MATCH))
+	{
+		if (!known) len = Find(pos, disp);
+		known = false;
+		Insert(pos);
+		if (!len)
+		{
+			Literal(*At(pos++));
+			continue;
+		}
+
+		// A longer match starting at the next byte is worth a literal
+		u32 nextDisp = 0, nextLen = len < LAZY_LIMIT ? Find(pos + 1, nextDisp) : 0;
+		if (nextLen > len)
+		{
+			Literal(*At(pos++));
+			len = nextLen;
+			disp = nextDisp;
+			known = true;
+			continue;
+		}
+
+		Match(len, disp);
+		for (u32 i = 1; i < len; i ++)
+			Insert(pos + i);
+		pos += len;
+	}
+
+	// Drop the input matches can no longer reach
+	if (pos - base > WINDOW)
+	{
+		window.erase(window.begin(), window.begin() + (size_t)(pos - WINDOW - base));
+		base = pos - WINDOW;
+	}
+}
+
+void LZ11Encoder::Update(const void* data, size_t bytes)
+{
+	const u8* in = (const u8*)data;
+	window.insert(window.end(), in, in + bytes);
+	Encode(false);
+}
+
+void LZ11Encoder::Finish()
+{
+	Encode(true);
+	count = 0;
+	while ((drained + out.size()) & 3)
+		out.push_back(0);
+}
+
+void LZ11Encoder::Drain()
+{
+	size_t ready = Ready();
+	out.erase(out.begin(), out.begin() + ready);
+	drained += ready;
+	if (count) flagPos -= ready;
+}
+
+void lz11_compress(const u8* data, size_t size, std::vector<u8>& out)
+{
+	LZ11Encoder enc(size);
+	if (size) enc.Update(data, size);
+	enc.Finish();
+	out.assign(enc.Output(), enc.Output() + enc.Ready());
+}
+
+bool lz11_decompress(const u8* data, size_t size, std::vector<u8>& out)
+{
+	if (size < 4 || data[0] != 0x11) return false;
+	u64 outSize = data[1] | data[2] << 8 | data[3] << 16;
+	size_t pos = 4;
+	if (!outSize)
+	{
+		if (size < 8) return false;
+		outSize = data[4] | data[5] << 8 | data[6] << 16 | (u64)data[7] << 24;
+		pos = 8;
+	}
+	// No token expands to more than 0x10110 bytes from 4, so larger sizes
+	// can only come from a corrupted header
+	if (outSize > (u64)(size - pos) * (MAX_MATCH / 4 + 1)) return false;
+	out.resize(outSize);
+
+	size_t done = 0;
+	while (done < outSize)
+	{
+		if (pos >= size) return false;
+		u8 flags = data[pos++];
+		for (int i = 0; i < 8 && done < outSize; i ++, flags <<= 1)
+		{
+			if (!(flags & 0x80))
+			{
+				if (pos >= size) return false;
+				out[done++] = data[pos++];
+				continue;
+			}
+
+			u32 len, disp;
+			const u8* p = data + pos;
+			switch (p[0] >> 4)
+			{
+				case 0:
+					if (pos + 3 > size) return false;
+					len = ((p[0] & 0xF) << 4 | p[1] >> 4) + 0x11;
+					disp = (p[1] & 0xF) << 8 | p[2];
+					pos += 3;
+					break;
+				case 1:
+					if (pos + 4 > size) return false;
+					len = ((p[0] & 0xF) << 12 | p[1] << 4 | p[2] >> 4) + 0x111;
+					disp = (p[2] & 0xF) << 8 | p[3];
+					pos += 4;
+					break;
+				default:
+					if (pos + 2 > size) return false;
+					len = (p[0] >> 4) + 1;
+					disp = (p[0] & 0xF) << 8 | p[1];
+					pos += 2;
+					break;
+			}
+			disp ++;
+			if (disp > done || len > outSize - done) return false;
+			// Byte by byte, the source may overlap what is being written
+			for (; len; len --, done ++)
+				out[done] = out[done - disp];
+		}
+	}
+	return true;
+}
+
+bool lz11_parse_exts(char* str, std::vector<std::string>& out)
+{
+	for (char* ext = strtok(str, ","); ext; ext = strtok(NULL, ","))
+	{
+		std::string e = ext[0] == '.' ? ext : std::string(".") + ext;
+		if (e.size() < 2) return false;
+		for (size_t i = 0; i < e.size(); i ++)
+			e[i] = tolower((unsigned char)e[i]);
+		out.push_back(e);
+	}
+	return !out.empty();
+}
+
+bool lz11_match_ext(const std::vector<std::string>& exts, const u16* name, u32 len)
+{
+	for (size_t i = 0; i < exts.size(); i ++)
+	{
+		const std::string& ext = exts[i];
+		if (ext.size() > len) continue;
+		const u16* tail = name + len - ext.size();
+		size_t j = 0;
+		for (; j < ext.size(); j ++)
+		{
+			u16 c = tail[j];
+			if (c >= 0x80 || tolower(c) != (unsigned char)ext[j])
+				break;
+		}
+		if (j == ext.size()) return true;
+	}
+	return false;
+}
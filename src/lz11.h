@@ -0,0 +1,68 @@
+#pragma once
+#include <stddef.h>
+#include <vector>
+#include <string>
+#include "types.h"
+
+// LZ11, the LZ77 variant the console's libraries decompress. A 4-byte
+// header holds the type 0x11 and the decompressed size (or 0 followed by a
+// 32-bit size for sizes above 16M). Each flag byte then describes the next
+// eight tokens, MSB first: a clear bit is a literal byte, a set bit a back
+// reference of 3 to 0x10110 bytes up to 0x1000 bytes back.
+
+#define LZ11_MAX_SIZE 0xFFFFFFFFULL
+
+// Compresses a stream of known size that is fed in pieces. Matches are
+// found through hash chains, lazily by one byte. Only the last 4K of input,
+// as far back as matches reach, and the longest possible match ahead of the
+// current position are kept, so memory use does not depend on the size of
+// the stream.
+class LZ11Encoder
+{
+	u64 size;               // Of the whole stream
+	std::vector<u8> window; // Input from position base on
+	u64 base, pos;          // pos is the next position to encode
+	std::vector<u32> head, prev; // Hash chains over the positions seen so far
+
+	std::vector<u8> out;    // Compressed data not drained yet
+	u64 drained;
+	size_t flagPos;         // Flag byte of the current group of eight tokens
+	int count;              // Tokens in that group
+
+	u32 len, disp;          // Match found by the lazy lookahead
+	bool known;
+
+	const u8* At(u64 p) const { return &window[p - base]; }
+	void Insert(u64 p);
+	u32 Find(u64 p, u32& matchDisp) const;
+	void Token(bool match);
+	void Literal(u8 c);
+	void Match(u32 matchLen, u32 matchDisp);
+	void Encode(bool final);
+
+public:
+	LZ11Encoder(u64 size);
+
+	// Passes on the next piece of input
+	void Update(const void* data, size_t bytes);
+	// Encodes what is left after all input has been passed on and pads the
+	// output to a multiple of 4
+	void Finish();
+
+	// Output that is final and can be written out, then dropped with Drain()
+	const u8* Output() const { return out.empty() ? NULL : &out.front(); }
+	size_t Ready() const { return count ? flagPos : out.size(); }
+	void Drain();
+};
+
+// Compresses size bytes in memory into out, padded to a multiple of 4
+void lz11_compress(const u8* data, size_t size, std::vector<u8>& out);
+
+// Returns false if the input is not valid LZ11 data
+bool lz11_decompress(const u8* data, size_t size, std::vector<u8>& out);
+
+// Parses a comma separated list of file extensions such as "bcstm,.bin"
+bool lz11_parse_exts(char* str, std::vector<std::string>& out);
+
+// Whether an entry name (UTF-16) ends in one of the extensions, ignoring case
+bool lz11_match_ext(const std::vector<std::string>& exts, const u16* name, u32 len);
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <vector>
 #include <map>
 #include <list>
@@ -9,6 +10,8 @@
 #include "elf.h"
 #include "FileClass.h"
 #include "romfs.h"
+#include "threadpool.h"
+#include "lz11.h"
 
 using std::vector;
 using std::map;
@@ -20,44 +23,400 @@ struct argInfo
 {
 	char* outFile;
 	char* romfsDir;
+	char* jobFile;
+	int ioLimit;
+	bool incremental;
+	romfs_opts_t opts;
 };
 
 int usage(const char* progName)
 {
 	fprintf(stderr,
 		"Usage:\n"
-		"    %s input_dir output.romfs\n\n"
-		, progName);
+		"    %s input_dir output.romfs [options]\n"
+		"    %s --file-list=FILE [input_dir] output.romfs [options]\n"
+		"    %s --jobs=FILE [options]\n\n"
+		"Options:\n"
+		"    --threads=N       : Number of threads used to scan the input (default: one per CPU).\n"
+		"    --readers=N       : Number of threads prefetching file data (default: 4).\n"
+		"    --readahead=SIZE  : Maximum file data buffered while writing, K/M/G suffixes allowed (default: 64M).\n"
+		"    --max-memory=SIZE : Upper bound on the file contents held in memory at once by all threads\n"
+		"                        together, readers wait once it is reached (default: no limit).\n"
+		"    --no-zero-copy    : Always copy file data through user space instead of letting the kernel do it.\n"
+		"    --sparse          : Leave holes in the output where the input files have them, and where\n"
+		"                        whole blocks of zeros go through user space (--no-zero-copy, --ivfc).\n"
+		"                        Files patched by --incremental get their holes punched as well.\n"
+		"    --dedupe          : Store the contents of identical files only once.\n"
+		"    --sort            : Order the entries of every directory by name, so that the same tree\n"
+		"                        always gives the same image regardless of the host file system.\n"
+		"    --hash-load=F     : Target number of entries per hash bucket, between 0 and 1. Lower values make\n"
+		"                        the tables larger and the chains walked on the device shorter (default: 1).\n"
+		"    --meta-order=ORDER: Order of the directory and file entries: dfs (default) as the tree is\n"
+		"                        walked, bfs breadth-first, or bucket to also keep the entries of each\n"
+		"                        hash chain together. Prints the metadata a lookup touches before and after.\n"
+		"    --hash-stats      : Print the bucket occupancy and chain lengths of the hash tables.\n"
+		"    --align=RULES     : Data alignment policy as comma separated SIZE:ALIGN rules. Files of at\n"
+		"                        least SIZE bytes are aligned to ALIGN (a power of two), e.g.\n"
+		"                        --align=64K:0x200,1M:0x1000. Smaller files stay packed 4-byte aligned\n"
+		"                        and fill the gaps in front of aligned ones, except files placed by\n"
+		"                        --trace, which keep their order.\n"
+		"    --trace=FILE      : Store file data in the order the paths listed in FILE (one per line, as\n"
+		"                        recorded from a real run) are first accessed, then all other files.\n"
+		"    --file-list=FILE  : Take the contents of the image from FILE instead of scanning input_dir.\n"
+		"                        Each line holds the path within the image, a tab, the host file and\n"
+		"                        optionally a tab and its size; a path on its own adds a directory.\n"
+		"                        Relative host paths are taken relative to input_dir when it is given.\n"
+		"    --lz11=EXTS       : Store files with one of the comma separated extensions (e.g. bcstm,bin)\n"
+		"                        LZ11 compressed, as the console's decompression functions expect.\n"
+		"    --base=IMAGE      : Start from the contents of an existing image, input_dir then only holds\n"
+		"                        the changes. Its files are added or replace those of the image and an\n"
+		"                        empty file named .wh.NAME deletes NAME. Unchanged data is copied\n"
+		"                        over from the image.\n"
+		"    --ivfc            : Wrap the image in the IVFC hash tree an NCCH container stores its RomFS in.\n"
+		"    --incremental     : Update the existing output in place where possible, tracking its\n"
+		"                        contents in output.romfs.manifest.\n"
+		"    --jobs=FILE       : Build several images in one go, FILE holds one input_dir, a tab and\n"
+		"                        output.romfs per line. The builds share one thread pool and every\n"
+		"                        input directory is only scanned once; all other options apply to all.\n"
+		"    --io-limit=N      : Maximum number of threads reading or writing files at the same time,\n"
+		"                        across all builds (default: no limit).\n"
+		, progName, progName, progName);
 	return 1;
 }
 
+// Parses an alignment policy such as "64K:0x200,4M:0x1000"
+static bool parseAlign(char* str, std::vector<romfs_align_t>& out)
+{
+	for (char* rule = strtok(str, ","); rule; rule = strtok(NULL, ","))
+	{
+		char* sep = strchr(rule, ':');
+		if (!sep) return false;
+		*sep = 0;
+		romfs_align_t align;
+		u64 value;
+		if (!parseSize(rule, align.minSize) || !parseSize(sep + 1, value))
+			return false;
+		if (value < 4 || value > 0x100000 || (value & (value - 1)))
+			return false;
+		align.align = (u32)value;
+		out.push_back(align);
+	}
+	return !out.empty();
+}
+
 int parseArgs(argInfo& info, int argc, char* argv[])
 {
-	memset(&info, 0, sizeof(info));
+	info.outFile = NULL;
+	info.romfsDir = NULL;
+	info.jobFile = NULL;
+	info.ioLimit = 0;
+	info.incremental = false;
 
 	int status = 0;
 	for (int i = 1; i < argc; i ++)
 	{
 		char* arg = argv[i];
-		switch (status++)
+		if (arg[0] == '-' && arg[1] == '-')
 		{
-			case 1: info.outFile = arg; break;
-			case 0: info.romfsDir = arg; break;
-			default: return usage(argv[0]);
+			arg += 2;
+			char* value = strchr(arg, '=');
+			if (value)
+			{
+				*value++ = 0;
+				if (!*value) return usage(argv[0]);
+			}
+
+			if (!value)
+			{
+				if (strcmp(arg, "no-zero-copy")==0)
+					info.opts.zeroCopy = false;
+				else if (strcmp(arg, "incremental")==0)
+					info.incremental = true;
+				else if (strcmp(arg, "dedupe")==0)
+					info.opts.dedupe = true;
+				else if (strcmp(arg, "hash-stats")==0)
+					info.opts.hashStats = true;
+				else if (strcmp(arg, "sort")==0)
+					info.opts.sort = true;
+				else if (strcmp(arg, "ivfc")==0)
+					info.opts.ivfc = true;
+				else if (strcmp(arg, "sparse")==0)
+					info.opts.sparse = true;
+				else
+					return usage(argv[0]);
+			}
+			else if (strcmp(arg, "threads")==0)
+				info.opts.threads = atoi(value);
+			else if (strcmp(arg, "readers")==0)
+				info.opts.readers = atoi(value);
+			else if (strcmp(arg, "readahead")==0)
+			{
+				if (!parseSize(value, info.opts.readAhead)) return usage(argv[0]);
+			}
+			else if (strcmp(arg, "max-memory")==0)
+			{
+				if (!parseSize(value, info.opts.maxMemory) || !info.opts.maxMemory) return usage(argv[0]);
+			}
+			else if (strcmp(arg, "align")==0)
+			{
+				if (!parseAlign(value, info.opts.align)) return usage(argv[0]);
+			}
+			else if (strcmp(arg, "meta-order")==0)
+			{
+				if (strcmp(value, "dfs")==0)
+					info.opts.metaOrder = ROMFS_META_DFS;
+				else if (strcmp(value, "bfs")==0)
+					info.opts.metaOrder = ROMFS_META_BFS;
+				else if (strcmp(value, "bucket")==0)
+					info.opts.metaOrder = ROMFS_META_BUCKET;
+				else
+					return usage(argv[0]);
+			}
+			else if (strcmp(arg, "trace")==0)
+				info.opts.traceFile = value;
+			else if (strcmp(arg, "file-list")==0)
+				info.opts.fileList = value;
+			else if (strcmp(arg, "lz11")==0)
+			{
+				if (!lz11_parse_exts(value, info.opts.lz11)) return usage(argv[0]);
+			}
+			else if (strcmp(arg, "base")==0)
+				info.opts.base = value;
+			else if (strcmp(arg, "jobs")==0)
+				info.jobFile = value;
+			else if (strcmp(arg, "io-limit")==0)
+			{
+				info.ioLimit = atoi(value);
+				if (info.ioLimit <= 0) return usage(argv[0]);
+			}
+			else if (strcmp(arg, "hash-load")==0)
+			{
+				char* end;
+				info.opts.hashLoad = strtod(value, &end);
+				if (*end || !(info.opts.hashLoad > 0 && info.opts.hashLoad <= 1)) return usage(argv[0]);
+			}
+			else
+				return usage(argv[0]);
+		} else
+		{
+			switch (status++)
+			{
+				case 1: info.outFile = arg; break;
+				case 0: info.romfsDir = arg; break;
+				default: return usage(argv[0]);
+			}
 		}
 	}
+	// Patching the image in place would leave the hash tree stale
+	if (info.incremental && info.opts.ivfc)
+		return usage(argv[0]);
+
+	// Inputs and outputs all come from the job list
+	if (info.jobFile)
+		return status || info.opts.fileList ? usage(argv[0]) : 0;
+
+	// A file list makes the input directory optional
+	if (status == 1 && info.opts.fileList)
+	{
+		info.outFile = info.romfsDir;
+		info.romfsDir = NULL;
+		return 0;
+	}
 	return status < 2 ? usage(argv[0]) : 0;
 }
 
-int main(int argc, char* argv[])
+// Whether two paths name the same file
+static bool sameFile(const char* a, const char* b)
 {
-	argInfo args;
-	safe_call(parseArgs(args, argc, argv));
+#ifdef WIN32
+	char fullA[MAX_PATH], fullB[MAX_PATH];
+	return GetFullPathNameA(a, MAX_PATH, fullA, NULL) && GetFullPathNameA(b, MAX_PATH, fullB, NULL)
+		&& _stricmp(fullA, fullB) == 0;
+#else
+	struct stat statA, statB;
+	return stat(a, &statA) == 0 && stat(b, &statB) == 0 && statA.st_dev == statB.st_dev && statA.st_ino == statB.st_ino;
+#endif
+}
+
+static int buildImage(const romfs_opts_t& opts, const char* romfsDir, const char* outFile, bool incremental)
+{
+	// The data of the base image is copied over while the output is written
+	if (opts.base && sameFile(opts.base, outFile))
+		die("The output cannot replace the base image");
 
-	RomFS romfs;
-	safe_call(romfs.Build(args.romfsDir));
-	FileClass fout(args.outFile, "wb");
+	RomFS romfs(opts);
+	safe_call(romfs.Build(romfsDir));
+	if (incremental)
+		return romfs.WriteIncremental(outFile);
+
+	FileClass fout(outFile, "wb");
 	safe_call(romfs.WriteToFile(fout));
 
 	return 0;
 }
+
+// Absolute form of an output path that may not exist yet, for telling
+// whether two spellings name the same file
+static std::string outputKey(const std::string& path)
+{
+#ifdef WIN32
+	char full[MAX_PATH];
+	std::string key = GetFullPathNameA(path.c_str(), MAX_PATH, full, NULL) ? full : path;
+	for (size_t i = 0; i < key.size(); i ++)
+		key[i] = key[i] == '/' ? '\\' : tolower((unsigned char)key[i]);
+	return key;
+#else
+	size_t slash = path.rfind('/');
+	std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+	char full[PATH_MAX];
+	if (!realpath(dir.c_str(), full)) return path;
+	return std::string(full) + "/" + path.substr(slash == std::string::npos ? 0 : slash + 1);
+#endif
+}
+
+struct job_t
+{
+	std::string romfsDir, outFile;
+	int rc;
+};
+
+struct batch_t
+{
+	vector<job_t> jobs;
+	romfs_opts_t opts;
+	bool incremental;
+
+	pthread_mutex_t lock;
+	size_t next; // First job nobody has picked up yet
+};
+
+static int loadJobs(const char* path, vector<job_t>& jobs)
+{
+	FILE* f = fopen(path, "r");
+	if (!f) die("Cannot open job list");
+
+	bool failed = false;
+	u32 lineNo = 0;
+	char buf[4096];
+	std::string line;
+	while (!failed && fgets(buf, sizeof(buf), f))
+	{
+		line += buf;
+		if (line[line.size()-1] != '\n' && !feof(f))
+			continue;
+		lineNo ++;
+		while (!line.empty() && (line[line.size()-1] == '\n' || line[line.size()-1] == '\r'))
+			line.erase(line.size()-1);
+		if (line.empty() || line[0] == '#')
+		{
+			line.clear();
+			continue;
+		}
+
+		size_t tab = line.find('\t');
+		if (tab == 0 || tab == std::string::npos || tab+1 == line.size() || line.find('\t', tab+1) != std::string::npos)
+		{
+			fprintf(stderr, "Invalid entry in job list line %u: %s\n", lineNo, line.c_str());
+			failed = true;
+		} else
+		{
+			job_t job;
+			job.romfsDir = line.substr(0, tab);
+			job.outFile = line.substr(tab + 1);
+			job.rc = 0;
+			jobs.push_back(job);
+		}
+		line.clear();
+	}
+	fclose(f);
+	if (failed) return 1;
+	if (jobs.empty()) die("The job list is empty");
+
+	// Builds running side by side would write over each other
+	map<std::string, size_t> outputs;
+	for (size_t i = 0; i < jobs.size(); i ++)
+	{
+		std::pair<map<std::string, size_t>::iterator, bool> ins = outputs.insert(std::make_pair(outputKey(jobs[i].outFile), i));
+		if (!ins.second)
+		{
+			fprintf(stderr, "More than one job writes %s\n", jobs[i].outFile.c_str());
+			failed = true;
+		}
+	}
+	return failed ? 1 : 0;
+}
+
+static void* jobRunner(void* arg)
+{
+	batch_t* batch = (batch_t*)arg;
+	for (;;)
+	{
+		pthread_mutex_lock(&batch->lock);
+		size_t i = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+		if (i >= batch->jobs.size()) break;
+
+		job_t& job = batch->jobs[i];
+		job.rc = buildImage(batch->opts, job.romfsDir.c_str(), job.outFile.c_str(), batch->incremental);
+		if (job.rc != 0)
+			fprintf(stderr, "Could not build %s from %s\n", job.outFile.c_str(), job.romfsDir.c_str());
+	}
+	return NULL;
+}
+
+// Runs the builds of a job list side by side. They hand all their work to
+// one pool and mostly wait for it, helping out in the meantime, so as many
+// builds run at once as the pool has threads.
+static int runJobs(const argInfo& args)
+{
+	batch_t batch;
+	safe_call(loadJobs(args.jobFile, batch.jobs));
+
+	ThreadPool pool(args.opts.threads);
+	IoLimit ioLimit(args.ioLimit);
+	ScanCache scanCache;
+	// This thread runs builds as well
+	size_t numRunners = batch.jobs.size() < (size_t)pool.NumThreads() ? batch.jobs.size() : pool.NumThreads();
+	pool.SetHelpers(numRunners);
+	batch.opts = args.opts;
+	// The memory budget covers all builds together
+	batch.opts.maxMemory = args.opts.maxMemory / numRunners;
+	if (args.opts.maxMemory && !batch.opts.maxMemory)
+		batch.opts.maxMemory = 1;
+	batch.opts.pool = &pool;
+	batch.opts.ioLimit = args.ioLimit ? &ioLimit : NULL;
+	batch.opts.scanCache = &scanCache;
+	batch.incremental = args.incremental;
+	batch.next = 0;
+	pthread_mutex_init(&batch.lock, NULL);
+
+	vector<pthread_t> runners;
+	for (size_t i = 1; i < numRunners; i ++)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, jobRunner, &batch) != 0)
+			break;
+		runners.push_back(thread);
+	}
+	jobRunner(&batch);
+	for (size_t i = 0; i < runners.size(); i ++)
+		pthread_join(runners[i], NULL);
+	pthread_mutex_destroy(&batch.lock);
+
+	u32 built = 0;
+	for (size_t i = 0; i < batch.jobs.size(); i ++)
+		if (batch.jobs[i].rc == 0)
+			built ++;
+	printf("Built %u of %u images\n", built, (u32)batch.jobs.size());
+	return built == batch.jobs.size() ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+	argInfo args;
+	safe_call(parseArgs(args, argc, argv));
+
+	if (args.jobFile)
+		return runJobs(args);
+	return buildImage(args.opts, args.romfsDir, args.outFile, args.incremental);
+}
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "readahead.h"
+#include "zerocopy.h"
+
+#define die(msg) do { fputs(msg "\n\n", stderr); return 1; } while(0)
+
+#define CHUNK_SIZE 0x100000
+
+ReadAhead::ReadAhead(u64 maxInFlight, IoLimit* ioLimit) :
+	items(), window(), threads(),
+	chunkSize(CHUNK_SIZE), maxInFlight(maxInFlight), inFlight(0),
+	nextItem(0), nextOffset(0), quit(false), ioLimit(ioLimit)
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+
+	if (this->maxInFlight < chunkSize)
+	{
+		// A single chunk must always fit within the budget
+		if (this->maxInFlight < 0x1000) this->maxInFlight = 0x1000;
+		chunkSize = (size_t)this->maxInFlight;
+	}
+}
+
+ReadAhead::~ReadAhead()
+{
+	pthread_mutex_lock(&lock);
+	quit = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+
+	for (unsigned i = 0; i < threads.size(); i ++)
+		pthread_join(threads[i], NULL);
+
+	for (std::deque<Chunk>::iterator it = window.begin(); it != window.end(); ++it)
+		free(it->data);
+
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void ReadAhead::Add(const oschar_t* path, u64 offset, u64 size)
+{
+	if (!size) return; // Nothing to read
+	Item item;
+	item.path = path;
+	item.offset = offset;
+	item.size = size;
+	items.push_back(item);
+}
+
+int ReadAhead::Start(int numReaders)
+{
+	if (numReaders < 1) numReaders = 1;
+	for (int i = 0; i < numReaders; i ++)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, ReaderMain, this) != 0)
+			break;
+		threads.push_back(thread);
+	}
+	if (threads.empty()) die("Could not start reader threads");
+	return 0;
+}
+
+// Must be called with the lock held
+bool ReadAhead::ClaimChunk(Chunk*& chunk)
+{
+	while (!quit && nextItem < items.size())
+	{
+		const Item& item = items[nextItem];
+		u64 size = item.size - nextOffset;
+		if (size > chunkSize) size = chunkSize;
+
+		if (inFlight && inFlight + size > maxInFlight)
+		{
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+
+		window.push_back(Chunk());
+		chunk = &window.back();
+		chunk->item = &item;
+		chunk->offset = nextOffset;
+		chunk->size = (size_t)size;
+		chunk->data = NULL;
+		chunk->ready = chunk->failed = false;
+		inFlight += size;
+
+		nextOffset += size;
+		if (nextOffset == item.size)
+		{
+			nextItem ++;
+			nextOffset = 0;
+		}
+		return true;
+	}
+	return false;
+}
+
+bool ReadAhead::ReadChunk(Chunk& chunk)
+{
+	chunk.data = (u8*)malloc(chunk.size);
+	if (!chunk.data) return false;
+
+	const oschar_t* path = chunk.item->path;
+	bool rc = true;
+#ifdef WIN32
+	HANDLE hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER pos;
+	pos.QuadPart = chunk.item->offset + chunk.offset;
+	DWORD bytesRead = 0;
+	rc = SetFilePointerEx(hFile, pos, NULL, FILE_BEGIN)
+		&& ReadFile(hFile, chunk.data, chunk.size, &bytesRead, NULL)
+		&& bytesRead == chunk.size;
+	CloseHandle(hFile);
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+
+	// Holes of sparse files are filled in instead of read
+	u64 start = chunk.item->offset + chunk.offset, end = start + chunk.size;
+	u64 pos = start, filled = start, dataEnd;
+	while (rc && findData(fd, pos, end, dataEnd))
+	{
+		memset(chunk.data + (filled - start), 0, pos - filled);
+		while (rc && pos < dataEnd)
+		{
+			ssize_t n = pread(fd, chunk.data + (pos - start), dataEnd - pos, pos);
+			rc = n > 0;
+			if (rc) pos += n;
+		}
+		filled = pos;
+	}
+	if (rc)
+		memset(chunk.data + (filled - start), 0, end - filled);
+	close(fd);
+#endif
+	return rc;
+}
+
+void* ReadAhead::ReaderMain(void* arg)
+{
+	ReadAhead* self = (ReadAhead*)arg;
+	pthread_mutex_lock(&self->lock);
+	for (;;)
+	{
+		Chunk* chunk;
+		if (!self->ClaimChunk(chunk))
+			break;
+		pthread_mutex_unlock(&self->lock);
+
+		if (self->ioLimit) self->ioLimit->Acquire();
+		bool rc = ReadChunk(*chunk);
+		if (self->ioLimit) self->ioLimit->Release();
+
+		pthread_mutex_lock(&self->lock);
+		chunk->ready = true;
+		chunk->failed = !rc;
+		pthread_cond_broadcast(&self->cond);
+	}
+	pthread_mutex_unlock(&self->lock);
+	return NULL;
+}
+
+int ReadAhead::Next(const u8*& data, size_t& size)
+{
+	pthread_mutex_lock(&lock);
+	while (window.empty() || !window.front().ready)
+		pthread_cond_wait(&cond, &lock);
+	Chunk& chunk = window.front();
+	pthread_mutex_unlock(&lock);
+
+	if (chunk.failed)
+	{
+#ifdef WIN32
+		fwprintf(stderr, L"Could not read file %ls!\n", chunk.item->path);
+#else
+		fprintf(stderr, "Could not read file %s!\n", chunk.item->path);
+#endif
+		return 1;
+	}
+
+	data = chunk.data;
+	size = chunk.size;
+	return 0;
+}
+
+void ReadAhead::Release()
+{
+	pthread_mutex_lock(&lock);
+	Chunk& chunk = window.front();
+	free(chunk.data);
+	inFlight -= chunk.size;
+	window.pop_front();
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
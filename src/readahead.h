@@ -0,0 +1,59 @@
+#pragma once
+#include <pthread.h>
+#include <deque>
+#include <vector>
+#include "types.h"
+#include "romfs.h"
+#include "threadpool.h"
+
+// Bounded producer/consumer pipeline that prefetches a list of host files.
+// A pool of reader threads reads the files in list order, one chunk at a
+// time, while the consumer drains the chunks in the same order. Budget is
+// handed out strictly in order, so the chunk the consumer is waiting for
+// can always be read no matter how small the in-flight limit is.
+class ReadAhead
+{
+	struct Item
+	{
+		const oschar_t* path;
+		u64 offset, size;
+	};
+
+	struct Chunk
+	{
+		const Item* item;
+		u64 offset;
+		size_t size;
+		u8* data;
+		bool ready, failed;
+	};
+
+	std::vector<Item> items;
+	std::deque<Chunk> window; // Claimed chunks, front is the next one to consume
+	std::vector<pthread_t> threads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	size_t chunkSize;
+	u64 maxInFlight, inFlight;
+	size_t nextItem;
+	u64 nextOffset;
+	bool quit;
+	IoLimit* ioLimit;
+
+	static void* ReaderMain(void* arg);
+	bool ClaimChunk(Chunk*& chunk);
+	static bool ReadChunk(Chunk& chunk);
+
+public:
+	ReadAhead(u64 maxInFlight, IoLimit* ioLimit = NULL);
+	~ReadAhead();
+
+	void Add(const oschar_t* path, u64 offset, u64 size);
+	int Start(int numReaders);
+
+	// Returns the next chunk of file data in order, blocking until it has been read
+	int Next(const u8*& data, size_t& size);
+	void Release();
+};
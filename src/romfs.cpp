@@ -3,15 +3,37 @@
 #include <string.h>
 #include <vector>
 #include <map>
-#include <list>
 #include <algorithm>
+#ifdef WIN32
+#include <io.h>
+#include <winioctl.h>
+#endif
 #include "types.h"
 #include "FileClass.h"
 #include "romfs.h"
+#include "threadpool.h"
+#include "readahead.h"
+#include "zerocopy.h"
+#include "sha256.h"
+#include "ivfc.h"
+#include "lz11.h"
+#include "romfsreader.h"
+#include "utf.h"
 
 #define die(msg) do { fputs(msg "\n\n", stderr); return 1; } while(0)
 #define safe_call(a) do { int rc = a; if(rc != 0) return rc; } while(0)
 
+#define COPY_BUF_SIZE 0x100000
+#define SPARSE_BLOCK 0x1000 // Granularity of the holes left in sparse output
+
+// Prefix of the overlay entries that delete what follows it from the base image
+#ifdef WIN32
+#define WHITEOUT L".wh."
+#else
+#define WHITEOUT ".wh."
+#endif
+#define WHITEOUT_LEN 4
+
 // Apparently this is Nintendo's version of "Smallest prime >= the input"
 static u32 calcHashTableLen(u32 entryCount)
 {
@@ -24,131 +46,405 @@ static u32 calcHashTableLen(u32 entryCount)
 #undef D
 }
 
-static u32 calcHash(u32 parent, const romfs_str& str, u32 total)
-{
-	u32 hash = parent ^ 123456789;
-	for (u32 i = 0; i < str.size(); i ++)
-	{
-		hash = (hash >> 5) | (hash << 27);
-		hash ^= str[i];
-	}
-	return hash % total;
-}
-
-RomFS::RomFS() :
+RomFS::RomFS(const romfs_opts_t& opts) :
+	opts(opts),
 	dirHashTable(NULL), fileHashTable(NULL),
 	dirOff(0), fileOff(0), fileDataOff(0),
-	dirs(), files()
+	dirs(), files(), hosts(), names(), hostPaths(), dataOrder(), tracedFiles(0), ownPool(NULL), spoolPaths()
 {
 	// Create the root
-	AddDir(NULL, NULL);
+	AddDir(ROMFS_NONE, NULL);
 }
 
 RomFS::~RomFS()
 {
 	if (dirHashTable) free(dirHashTable);
 	if (fileHashTable) free(fileHashTable);
+	delete ownPool;
+	for (size_t i = 0; i < spoolPaths.size(); i ++)
+	{
+#ifdef WIN32
+		_wremove(spoolPaths[i].c_str());
+#else
+		remove(spoolPaths[i].c_str());
+#endif
+	}
+}
+
+ThreadPool& RomFS::Pool()
+{
+	if (opts.pool) return *opts.pool;
+	if (!ownPool) ownPool = new ThreadPool(opts.threads);
+	return *ownPool;
 }
 
 int RomFS::Build(const char* path)
 {
+	// With a file list the directory is optional and only serves as the
+	// base of relative host paths
+	if (!path) path = "";
 #ifndef WIN32
-	safe_call(ScanDir(Root(), path));
+	romfs_scan_dir_t tree(path);
 #else
 	WCHAR buf[OSPATHLEN];
 	if (!MultiByteToWideChar(CP_ACP, 0, path, -1, buf, OSPATHLEN))
 		die("Cannot convert to Unicode");
-	safe_call(ScanDir(Root(), buf));
+	romfs_scan_dir_t tree(buf);
 #endif
+	romfs_scan_dir_t* root = &tree;
+	if (opts.fileList)
+		safe_call(LoadFileList(tree));
+	else if (opts.scanCache && !opts.base) // Overlays get taken apart
+		safe_call(ScanCached(root));
+	else
+		safe_call(ScanTree(tree));
+
+	romfs_scan_dir_t base((osstring()));
+	if (opts.base)
+	{
+		safe_call(LoadBase(base, tree));
+		root = &base;
+	}
+	ReserveTree(*root);
+	AddTree(0, *root);
+	if (!opts.lz11.empty())
+		safe_call(CompressFiles());
+	if (opts.dedupe)
+		safe_call(Dedupe());
+	safe_call(OrderData());
+	LayoutData();
+	OrderMeta();
 	safe_call(CalcHash());
 	return 0;
 }
 
-static inline u32 offset(romfs_meta_t* m)
+template <typename T>
+static inline u32 offset(const std::vector<T>& table, u32 index)
 {
-	return m ? m->offset : (~0);
+	return index != ROMFS_NONE ? table[index].offset : (~0);
 }
 
-#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-static void writeWordArraySlow(FileClass& f, const u32* start, const u32* end)
+static inline u8* putWord(u8* p, u32 value)
 {
-	for (; start < end; start ++)
-		f.WriteWord(*start);
+	value = le_word(value);
+	memcpy(p, &value, 4);
+	return p + 4;
 }
 
-static void writeHwordArraySlow(FileClass& f, const u16* start, const u16* end)
+static inline u8* putDword(u8* p, u64 value)
 {
-	for (; start < end; start ++)
-		f.WriteHword(*start);
+	value = le_dword(value);
+	memcpy(p, &value, 8);
+	return p + 8;
 }
-#endif
 
-int RomFS::WriteToFile(FileClass& f)
+static u8* putWordArray(u8* p, const u32* data, u32 count)
 {
-	u32 counter = 0x28, temp;
-	f.WriteWord(counter);
-	f.WriteWord(counter);
-	temp = dirHashCount*4; f.WriteWord(temp); counter += temp;
-	f.WriteWord(counter);
-	f.WriteWord(dirOff); counter += dirOff;
-	f.WriteWord(counter);
-	temp = fileHashCount*4; f.WriteWord(temp); counter += temp;
-	f.WriteWord(counter);
-	f.WriteWord(fileOff); counter += fileOff;
-	f.WriteWord(counter);
-
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-	f.WriteRaw(dirHashTable, dirHashCount*4);
+	memcpy(p, data, count*4);
+	return p + count*4;
 #elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-	writeWordArraySlow(f, dirHashTable, dirHashTable+dirHashCount);
+	for (u32 i = 0; i < count; i ++)
+		p = putWord(p, data[i]);
+	return p;
 #endif
-	for (std::list<romfs_dir_t>::iterator it = dirs.begin(); it != dirs.end(); ++it)
-	{
-		romfs_dir_t& dir = *it;
-		f.WriteWord(offset(dir.parent));
-		f.WriteWord(offset(dir.sibling));
-		f.WriteWord(offset(dir.firstSubDir));
-		f.WriteWord(offset(dir.firstFile));
-		f.WriteWord(dir.nextHash);
-		f.WriteWord(dir.name.size()*2);
-		if (dir.name.size()==0) continue;
+}
+
+// Copies a name and skips the zero padding that follows it
+static u8* putName(u8* p, const u16* name, u32 len)
+{
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-		f.WriteRaw(&dir.name.front(), dir.name.size()*2);
+	if (len) memcpy(p, name, len*2);
 #elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-		writeHwordArraySlow(f, &dir.name.front(), &dir.name.front()+dir.name.size());
+	for (u32 i = 0; i < len; i ++)
+	{
+		u16 c = le_hword(name[i]);
+		memcpy(p + i*2, &c, 2);
+	}
 #endif
-		while (f.Tell() & 3) f.WriteByte(0);
+	return p + ((len*2 + 3) &~ 3);
+}
+
+// Lets the kernel move file contents straight into the output, starting
+// at position first of the data order. Stops at the first file it cannot
+// handle and leaves first there, so that the rest can be written the
+// buffered way.
+int RomFS::ZeroCopyData(FileClass& f, u32& first, bool sparse)
+{
+	f.Flush();
+	int outFd = zeroCopyTarget(f.get_ptr());
+	if (outFd < 0) return 0;
+
+	s64 base = f.Tell();
+	int rc = 0;
+	for (; first < dataOrder.size(); first ++)
+	{
+		u32 i = dataOrder[first];
+		romfs_file_t& file = files[i];
+		u32 pad = (u32)(SlotEnd(first) - file.dataOff - file.dataSize);
+		if (opts.ioLimit) opts.ioLimit->Acquire();
+		rc = zeroCopyFile(outFd, base + file.dataOff, HostPath(i), hosts[i].hostOff, file.dataSize, pad, sparse);
+		if (opts.ioLimit) opts.ioLimit->Release();
+		if (rc != 0) break;
 	}
 
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-	f.WriteRaw(fileHashTable, fileHashCount*4);
-#elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-	writeWordArraySlow(f, fileHashTable, fileHashTable+fileHashCount);
-#endif
-	for (std::list<romfs_file_t>::iterator it = files.begin(); it != files.end(); ++it)
+	f.Seek(base + (first < dataOrder.size() ? files[dataOrder[first]].dataOff : fileDataOff), SEEK_SET);
+	return rc > 0 ? rc : 0;
+}
+
+// End of the space set aside for the file at position k of the data order,
+// including the padding up to the next file
+u64 RomFS::SlotEnd(u32 k)
+{
+	return k+1 < dataOrder.size() ? files[dataOrder[k+1]].dataOff : fileDataOff;
+}
+
+// Where image data goes: the output and the IVFC hasher, if there is one.
+// When sparse, whole blocks of zeros are seeked over instead of written,
+// which leaves holes once the output is extended to its full size.
+struct image_out_t
+{
+	FileClass* f;
+	IvfcWriter* ivfc;
+	IoLimit* io;
+	bool sparse;
+};
+
+static inline bool isZero(const u8* p, size_t size)
+{
+	return !p[0] && memcmp(p, p + 1, size - 1) == 0;
+}
+
+static bool writeRaw(image_out_t& out, const void* data, size_t size)
+{
+	if (out.io) out.io->Acquire();
+	bool rc = out.f->WriteRaw(data, size);
+	if (out.io) out.io->Release();
+	return rc;
+}
+
+// The hasher may wait on the pool, so it is fed before taking an I/O slot
+static bool writeImage(image_out_t& out, const void* data, size_t size)
+{
+	if (out.ivfc) out.ivfc->Update(data, size);
+	if (!out.sparse) return writeRaw(out, data, size);
+
+	const u8* p = (const u8*)data;
+	u64 pos = out.f->Tell();
+	while (size)
 	{
-		romfs_file_t& file = *it;
-		f.WriteWord(offset(file.parent));
-		f.WriteWord(offset(file.sibling));
-		f.WriteDword(file.dataOff);
-		f.WriteDword(file.dataSize);
-		f.WriteWord(file.nextHash);
-		f.WriteWord(file.name.size()*2);
-		if (file.name.size()==0) continue;
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-		f.WriteRaw(&file.name.front(), file.name.size()*2);
-#elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-		writeHwordArraySlow(f, &file.name.front(), &file.name.front()+file.name.size());
+		// Gather blocks of the output up to the first one that differs in
+		// being all zeros, only whole blocks can become holes
+		size_t run = 0;
+		bool zero = false;
+		while (run < size)
+		{
+			size_t len = SPARSE_BLOCK - (pos + run) % SPARSE_BLOCK;
+			if (len > size - run) len = size - run;
+			bool blockZero = len == SPARSE_BLOCK && isZero(p + run, len);
+			if (run && blockZero != zero) break;
+			zero = blockZero;
+			run += len;
+		}
+
+		if (zero)
+			out.f->Seek(run, SEEK_CUR);
+		else if (!writeRaw(out, p, run))
+			return false;
+		p += run;
+		pos += run;
+		size -= run;
+	}
+	return true;
+}
+
+static bool writeZeros(image_out_t& out, u64 count)
+{
+	static const u8 zeros[SPARSE_BLOCK] = { 0 };
+	for (; count; )
+	{
+		size_t size = count < sizeof(zeros) ? (size_t)count : sizeof(zeros);
+		if (!writeImage(out, zeros, size)) return false;
+		count -= size;
+	}
+	return true;
+}
+
+// Holes can only be left in a regular file that ends where the image is
+// about to start, as everything beyond its end reads as zeros
+static bool canLeaveHoles(FileClass& f)
+{
+	f.Flush();
+	int fd = fileno(f.get_ptr());
+#ifdef WIN32
+	HANDLE h = (HANDLE)_get_osfhandle(fd);
+	if (h == INVALID_HANDLE_VALUE || GetFileType(h) != FILE_TYPE_DISK)
+		return false;
+	// NTFS only deallocates ranges of files marked as sparse
+	DWORD bytes;
+	DeviceIoControl(h, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytes, NULL);
+	return _filelengthi64(fd) == f.Tell();
+#else
+	struct stat statbuf;
+	return fstat(fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode) && statbuf.st_size == f.Tell();
+#endif
+}
+
+// Sets the size of the output to the current position, for images ending in a hole
+static bool extendOutput(FileClass& f)
+{
+	f.Flush();
+#ifdef WIN32
+	return _chsize_s(_fileno(f.get_ptr()), f.Tell()) == 0;
+#else
+	return ftruncate(fileno(f.get_ptr()), f.Tell()) == 0;
 #endif
-		while (f.Tell() & 3) f.WriteByte(0);
+}
+
+// Offset of the file data region, which follows all the metadata. It is
+// aligned like the most strictly aligned file, so that file offsets within
+// the image are aligned as well.
+u32 RomFS::DataStart()
+{
+	u32 end = 0x28 + dirHashCount*4 + dirOff + fileHashCount*4 + fileOff;
+	u32 align = 4;
+	for (size_t i = 0; i < opts.align.size(); i ++)
+		if (opts.align[i].align > align)
+			align = opts.align[i].align;
+	return (end + align - 1) &~ (align - 1);
+}
+
+// Lays out the whole metadata region (header, hash tables and entry
+// tables) into buf, which must hold DataStart() zeroed bytes
+void RomFS::SerializeMeta(u8* buf)
+{
+	u8* p = buf;
+	u32 counter = 0x28, temp;
+	p = putWord(p, counter);
+	p = putWord(p, counter);
+	temp = dirHashCount*4; p = putWord(p, temp); counter += temp;
+	p = putWord(p, counter);
+	p = putWord(p, dirOff); counter += dirOff;
+	p = putWord(p, counter);
+	temp = fileHashCount*4; p = putWord(p, temp); counter += temp;
+	p = putWord(p, counter);
+	p = putWord(p, fileOff);
+	p = putWord(p, DataStart());
+
+	p = putWordArray(p, dirHashTable, dirHashCount);
+	for (std::vector<romfs_dir_t>::iterator it = dirs.begin(); it != dirs.end(); ++it)
+	{
+		romfs_dir_t& dir = *it;
+		p = putWord(p, offset(dirs, dir.parent));
+		p = putWord(p, offset(dirs, dir.sibling));
+		p = putWord(p, offset(dirs, dir.firstSubDir));
+		p = putWord(p, offset(files, dir.firstFile));
+		p = putWord(p, dir.nextHash);
+		p = putWord(p, dir.nameLen*2);
+		p = putName(p, Name(dir), dir.nameLen);
 	}
 
-	for (std::list<romfs_file_t>::iterator it = files.begin(); it != files.end(); ++it)
+	p = putWordArray(p, fileHashTable, fileHashCount);
+	for (std::vector<romfs_file_t>::iterator it = files.begin(); it != files.end(); ++it)
 	{
 		romfs_file_t& file = *it;
-		f.WriteRaw(file.data, file.dataSize);
-		while (f.Tell() & 3) f.WriteByte(0);
+		p = putWord(p, offset(dirs, file.parent));
+		p = putWord(p, offset(files, file.sibling));
+		p = putDword(p, file.dataOff);
+		p = putDword(p, file.dataSize);
+		p = putWord(p, file.nextHash);
+		p = putWord(p, file.nameLen*2);
+		p = putName(p, Name(file), file.nameLen);
+	}
+}
+
+int RomFS::WriteToFile(FileClass& f)
+{
+	// The hash tree needs to see every byte of the image, so the kernel
+	// cannot be left to copy the file data on its own
+	IvfcWriter* ivfc = NULL;
+	if (opts.ivfc)
+	{
+		// Its two batches take a quarter of the memory budget at most
+		u32 batch = IVFC_BATCH;
+		if (opts.maxMemory && opts.maxMemory / 8 < batch)
+			batch = (u32)(opts.maxMemory / 8) &~ (IVFC_BLOCK_SIZE - 1);
+		if (batch < IVFC_BLOCK_SIZE) batch = IVFC_BLOCK_SIZE;
+
+		ivfc = new IvfcWriter((u64)DataStart() + fileDataOff, Pool(), batch);
+		u64 budget = opts.maxMemory;
+		if (budget) budget = budget > 2*(u64)batch ? budget - 2*batch : 0x1000;
+		int rc = ivfc->Begin(f);
+		if (rc == 0) rc = WriteImage(f, ivfc, budget);
+		if (rc == 0) rc = ivfc->Finish(f);
+		delete ivfc;
+		return rc;
+	}
+	return WriteImage(f, NULL, opts.maxMemory);
+}
+
+// Size of the buffer each of users threads copying or hashing file contents
+// gets, so that together they stay within the memory budget
+size_t RomFS::CopyBufSize(int users)
+{
+	u64 size = COPY_BUF_SIZE;
+	if (opts.maxMemory && opts.maxMemory / users < size)
+		size = opts.maxMemory / users;
+	return size < 0x1000 ? 0x1000 : (size_t)size;
+}
+
+int RomFS::WriteImage(FileClass& f, IvfcWriter* ivfc, u64 budget)
+{
+	// All offsets are known by now, so the metadata goes out in a single write
+	u32 metaSize = DataStart();
+	u8* meta = (u8*)calloc(metaSize, 1);
+	if (!meta) die("Out of memory!");
+	SerializeMeta(meta);
+
+	image_out_t out;
+	out.f = &f;
+	out.ivfc = ivfc;
+	out.io = opts.ioLimit;
+	out.sparse = opts.sparse && canLeaveHoles(f);
+
+	bool written = writeImage(out, meta, metaSize);
+	free(meta);
+	if (!written) die("Could not write output file");
+
+	u32 first = 0;
+	if (opts.zeroCopy && !ivfc)
+		safe_call(ZeroCopyData(f, first, out.sparse));
+
+	s64 base = f.Tell() - (first < dataOrder.size() ? files[dataOrder[first]].dataOff : fileDataOff);
+
+	// Whatever the kernel could not copy goes through our own buffers.
+	// File contents are never held in memory as a whole; reader threads
+	// prefetch them chunk by chunk while we write the previous ones out
+	ReadAhead reader(budget && budget < opts.readAhead ? budget : opts.readAhead, opts.ioLimit);
+	for (u32 k = first; k < dataOrder.size(); k ++)
+	{
+		u32 i = dataOrder[k];
+		reader.Add(HostPath(i), hosts[i].hostOff, files[i].dataSize);
+	}
+	safe_call(reader.Start(opts.readers));
+
+	for (u32 k = first; k < dataOrder.size(); k ++)
+	{
+		romfs_file_t& file = files[dataOrder[k]];
+		if (!writeZeros(out, base + file.dataOff - f.Tell())) die("Could not write output file");
+		for (u64 remaining = file.dataSize; remaining; )
+		{
+			const u8* data;
+			size_t size;
+			safe_call(reader.Next(data, size));
+			bool rc = writeImage(out, data, size);
+			reader.Release();
+			if (!rc) die("Could not write output file");
+			remaining -= size;
+		}
 	}
+	if (!writeZeros(out, base + fileDataOff - f.Tell())) die("Could not write output file");
+	if (out.sparse && !extendOutput(f)) die("Could not write output file");
 
 	return 0;
 }
@@ -160,258 +456,1862 @@ static u32 osstrlen(const oschar_t* str)
 	return i;
 }
 
-static oschar_t* osstrcpy(oschar_t* dest, const oschar_t* src, u32 size)
+// Frees the subtree without recursing, deep trees must not run out of stack
+romfs_scan_dir_t::~romfs_scan_dir_t()
 {
-	u32 i;
-	for (i = 0; i < size; i ++)
+	std::vector<romfs_scan_dir_t*> pending;
+	for (std::vector<romfs_scan_ent_t>::iterator it = entries.begin(); it != entries.end(); ++it)
+		if (it->dir) pending.push_back(it->dir);
+	while (!pending.empty())
 	{
-		dest[i] = src[i];
-		if (!dest[i]) break;
+		romfs_scan_dir_t* node = pending.back();
+		pending.pop_back();
+		for (std::vector<romfs_scan_ent_t>::iterator it = node->entries.begin(); it != node->entries.end(); ++it)
+			if (it->dir)
+			{
+				pending.push_back(it->dir);
+				it->dir = NULL;
+			}
+		delete node;
 	}
-	return dest+i;
 }
 
-int RomFS::ScanDir(romfs_dir_t& dir, const oschar_t* path)
+struct scan_ctx_t
 {
-	oschar_t buf[OSPATHLEN];
-	oschar_t* pos = osstrcpy(buf, path, OSPATHLEN);
-	u32 remSpace = OSPATHLEN - (pos-buf);
-	if (remSpace < 3) die("Path too long");
-	osstrcpy(pos, OSWILDCARD, remSpace);
+	ThreadPool* pool;
+	TaskGroup group;
+	IoLimit* io;
+	bool sort;
+	bool whiteouts; // Keep the hidden entries that mark deletions in an overlay
+	FailFlag failed;
+};
 
-#if WIN32
-#define _FILENAME  ffd.cFileName
-#define _FILESIZE  ((u64)ffd.nFileSizeLow | ((u64)ffd.nFileSizeHigh << 32))
-#define _FILEISHID (ffd.dwFileAttributes & (FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM))
-#define _FILEISDIR (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-	WIN32_FIND_DATAW ffd;
-	HANDLE hFind = FindFirstFileW(buf, &ffd);
-	if (hFind != INVALID_HANDLE_VALUE) do
-#else
-#define _FILENAME  pent->d_name
-#define _FILESIZE  statbuf.st_size
-#define _FILEISHID (pent->d_name[0] == '.')
-#define _FILEISDIR S_ISDIR(statbuf.st_mode)
-	DIR* _dir = opendir(path);
-	if (!_dir)
-	{
-		fprintf(stderr, "Failed to open directory %s!\n", path);
-		return 1;
+struct name_order_t
+{
+	const std::vector<u16>& keys;
+	const std::vector<size_t>& keyOffs;
+	const std::vector<romfs_scan_ent_t>& entries;
+
+	name_order_t(const std::vector<u16>& keys, const std::vector<size_t>& keyOffs, const std::vector<romfs_scan_ent_t>& entries) :
+		keys(keys), keyOffs(keyOffs), entries(entries) { }
+
+	bool operator()(u32 a, u32 b) const
+	{
+		const u16* keyA = keys.empty() ? NULL : &keys.front() + keyOffs[a];
+		const u16* keyB = keys.empty() ? NULL : &keys.front() + keyOffs[b];
+		size_t lenA = keyOffs[a+1] - keyOffs[a], lenB = keyOffs[b+1] - keyOffs[b];
+		size_t len = lenA < lenB ? lenA : lenB;
+		for (size_t i = 0; i < len; i ++)
+			if (keyA[i] != keyB[i])
+				return keyA[i] < keyB[i];
+		if (lenA != lenB)
+			return lenA < lenB;
+		// Distinct invalid UTF-8 names can turn into the same UTF-16 name
+		return entries[a].name < entries[b].name;
 	}
-	struct dirent* pent;
-	while ((pent = readdir(_dir)) != NULL)
-#endif
+};
+
+// Sorts a directory listing by UTF-16 name, the form names take in the
+// image, so that the layout no longer depends on the order readdir uses.
+// Every name is converted once up front and only indices are moved around.
+static void sortEntries(std::vector<romfs_scan_ent_t>& entries)
+{
+	u32 count = entries.size();
+	size_t total = 0;
+	for (u32 i = 0; i < count; i ++)
+		total += entries[i].name.size();
+
+	std::vector<u16> keys(total);
+	std::vector<size_t> keyOffs(count + 1);
+	size_t pos = 0;
+	for (u32 i = 0; i < count; i ++)
 	{
-		if (_FILEISHID)
-			continue;
+		const osstring& name = entries[i].name;
+		keyOffs[i] = pos;
+		if (name.empty()) continue;
+#ifdef WIN32
+		std::copy(name.begin(), name.end(), keys.begin() + pos);
+		pos += name.size();
+#else
+		pos += utf8_to_utf16(&keys[pos], name.c_str(), name.size());
+#endif
+	}
+	keyOffs[count] = pos;
+
+	std::vector<u32> order(count);
+	for (u32 i = 0; i < count; i ++)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), name_order_t(keys, keyOffs, entries));
 
-		osstrcpy(pos+1, _FILENAME, remSpace-1);
+	std::vector<romfs_scan_ent_t> sorted(count);
+	for (u32 i = 0; i < count; i ++)
+	{
+		romfs_scan_ent_t& from = entries[order[i]];
+		romfs_scan_ent_t& to = sorted[i];
+		to.name.swap(from.name);
+		to.hostPath.swap(from.hostPath);
+		to.size = from.size;
+		to.mtime = from.mtime;
+		to.inode = from.inode;
+		to.device = from.device;
+		to.hostOff = from.hostOff;
+		to.dir = from.dir;
+	}
+	entries.swap(sorted);
+}
 
 #ifndef WIN32
-		struct stat statbuf;
-		if (stat(buf, &statbuf) < 0) die("stat() failed");
+// A directory kept open while its subdirectories wait to be scanned, so
+// that they can be opened relative to it instead of by their full path
+struct scan_dir_fd_t
+{
+	int fd;
+	int refs; // Subdirectories not opened yet
+};
+
+static void releaseDirFd(scan_dir_fd_t* dir)
+{
+	if (dir && __atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		close(dir->fd);
+		delete dir;
+	}
+}
 #endif
 
-		if (_FILEISDIR)
-		{
-			if (pos[1]=='.' && (!pos[2] || (pos[2]=='.' && !pos[3])))
-				continue;
-			romfs_dir_t& child = AddDir(&dir, _FILENAME);
-			child.sibling = dir.firstSubDir;
-			dir.firstSubDir = &child;
-			safe_call(ScanDir(child, buf));
-		} else
-		{
-			romfs_file_t& child = AddFile(&dir, _FILENAME);
-			child.sibling = dir.firstFile;
-			dir.firstFile = &child;
-			child.dataSize = _FILESIZE;
-			child.dataOff = fileDataOff;
-			fileDataOff += child.dataSize;
-			fileDataOff = (fileDataOff + 3) &~ 3;
+struct scan_task_t
+{
+	scan_ctx_t* ctx;
+	romfs_scan_dir_t* node;
+#ifndef WIN32
+	scan_dir_fd_t* parent; // NULL for the root, which is opened by path
+	const char* name;      // Within the parent
+#endif
+};
 
-			child.data = malloc(child.dataSize);
-			if (!child.data) die("Out of memory");
+static void scanDirTask(void* arg);
 
-#ifdef WIN32
-			HANDLE hFile = CreateFileW(buf, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-			if (hFile == INVALID_HANDLE_VALUE) die("Could not open file");
+#ifndef WIN32
+// Adds one entry of a directory listing. Directories are recognized by
+// their d_type alone, only everything else gets stat()ed, relative to the
+// directory so the kernel does not have to walk the whole path again.
+static int addScanEntry(int dirFd, romfs_scan_dir_t& node, const char* name, unsigned char type, bool whiteouts)
+{
+	if (name[0] == '.' && !(whiteouts && strncmp(name, WHITEOUT, WHITEOUT_LEN) == 0))
+		return 0; // Hidden, this also skips . and ..
 
-			DWORD bytesRead = 0;
-			BOOL rc = ReadFile(hFile, child.data, child.dataSize, &bytesRead, NULL);
-			CloseHandle(hFile);
+	romfs_scan_ent_t ent;
+	ent.name = name;
+	bool isDir = type == DT_DIR;
+	if (!isDir)
+	{
+		struct stat statbuf;
+		if (fstatat(dirFd, name, &statbuf, 0) < 0)
+			die("stat() failed");
+		isDir = S_ISDIR(statbuf.st_mode);
+		if (!isDir)
+		{
+			ent.size = statbuf.st_size;
+#ifdef __APPLE__
+			ent.mtime = (u64)statbuf.st_mtimespec.tv_sec*1000000000 + statbuf.st_mtimespec.tv_nsec;
 #else
-			int fd = open(buf, O_RDONLY);
-			if (fd < 0) die("Could not open file");
-
-			bool rc = read(fd, child.data, child.dataSize) == child.dataSize;
-			close(fd);
+			ent.mtime = (u64)statbuf.st_mtim.tv_sec*1000000000 + statbuf.st_mtim.tv_nsec;
 #endif
-
-			if (!rc) die("Could not read file");
+			ent.inode = statbuf.st_ino;
+			ent.device = statbuf.st_dev;
 		}
 	}
-#ifdef WIN32
-	while (FindNextFileW(hFind, &ffd));
-	FindClose(hFind);
-#else
-	closedir(_dir);
-#endif
-
+	if (isDir)
+		ent.dir = new romfs_scan_dir_t(node.path + OSWILDCARD + ent.name);
+	node.entries.push_back(ent);
 	return 0;
 }
 
-int RomFS::CalcHash(void)
+#ifdef __linux__
+#include <sys/syscall.h>
+
+struct linux_dirent64
 {
-	dirHashCount = calcHashTableLen(dirs.size());
-	fileHashCount = calcHashTableLen(files.size());
-	dirHashTable = (u32*)malloc(dirHashCount*4);
-	fileHashTable = (u32*)malloc(fileHashCount*4);
-	if (!dirHashTable || !fileHashTable) die("Out of memory!");
+	u64 d_ino;
+	dlong_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
 
-	memset(dirHashTable, 0xFF, dirHashCount*4);
-	memset(fileHashTable, 0xFF, fileHashCount*4);
+// Pulls the entries out of the kernel in 64K batches, instead of the
+// smaller ones readdir() asks for
+static int listDir(int fd, romfs_scan_dir_t& node, bool whiteouts)
+{
+	u64 buf[0x2000];
+	for (;;)
+	{
+		long len = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+		if (len < 0)
+			die("getdents64() failed");
+		if (len == 0) break;
 
-	for (std::list<romfs_dir_t>::iterator it = dirs.begin(); it != dirs.end(); ++it)
+		for (long pos = 0; pos < len; )
+		{
+			struct linux_dirent64* pent = (struct linux_dirent64*)((char*)buf + pos);
+			pos += pent->d_reclen;
+			if (addScanEntry(fd, node, pent->d_name, pent->d_type, whiteouts) != 0)
+				return 1;
+		}
+	}
+	return 0;
+}
+#else
+static int listDir(int fd, romfs_scan_dir_t& node, bool whiteouts)
+{
+	// The stream takes over its descriptor, fd stays open for the subdirectories
+	int dup_fd = dup(fd);
+	DIR* dir = dup_fd >= 0 ? fdopendir(dup_fd) : NULL;
+	if (!dir)
 	{
-		romfs_dir_t& dir = *it;
-		u32 hash = calcHash(dir.parent->offset, dir.name, dirHashCount);
-		dir.nextHash = dirHashTable[hash];
-		dirHashTable[hash] = dir.offset;
+		if (dup_fd >= 0) close(dup_fd);
+		die("fdopendir() failed");
 	}
-
-	for (std::list<romfs_file_t>::iterator it = files.begin(); it != files.end(); ++it)
+	struct dirent* pent;
+	while ((pent = readdir(dir)) != NULL)
 	{
-		romfs_file_t& file = *it;
-		u32 hash = calcHash(file.parent->offset, file.name, fileHashCount);
-		file.nextHash = fileHashTable[hash];
-		fileHashTable[hash] = file.offset;
+		if (addScanEntry(dirfd(dir), node, pent->d_name, pent->d_type, whiteouts) != 0)
+		{
+			closedir(dir);
+			return 1;
+		}
 	}
-
+	closedir(dir);
 	return 0;
 }
+#endif
+#endif
 
-#ifndef WIN32
-// Function written by mtheall
-static ssize_t decode_utf8(uint32_t *out, const uint8_t *in)
+// Lists a single directory. Subdirectories are queued on the pool as new
+// tasks instead of being recursed into, so idle workers can steal them.
+static int scanDirNode(scan_task_t* task)
 {
-	uint8_t code1, code2, code3, code4;
+	scan_ctx_t* ctx = task->ctx;
+	romfs_scan_dir_t& node = *task->node;
+#ifdef WIN32
+	osstring buf = node.path + OSWILDCARD;
+	WIN32_FIND_DATAW ffd;
+	HANDLE hFind = FindFirstFileW(buf.c_str(), &ffd);
+	if (hFind != INVALID_HANDLE_VALUE) do
+	{
+		if (ffd.dwFileAttributes & (FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM))
+			continue;
 
-	code1 = *in++;
-	if (code1 < 0x80)
+		romfs_scan_ent_t ent;
+		ent.name = ffd.cFileName;
+		if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			if (ent.name == L"." || ent.name == L"..")
+				continue;
+			ent.dir = new romfs_scan_dir_t(node.path + L"\\" + ent.name);
+		} else
+		{
+			ent.size = (u64)ffd.nFileSizeLow | ((u64)ffd.nFileSizeHigh << 32);
+			ent.mtime = (u64)ffd.ftLastWriteTime.dwLowDateTime | ((u64)ffd.ftLastWriteTime.dwHighDateTime << 32);
+		}
+		node.entries.push_back(ent);
+	} while (FindNextFileW(hFind, &ffd));
+	FindClose(hFind);
+#else
+	int fd = task->parent ? openat(task->parent->fd, task->name, O_RDONLY | O_DIRECTORY)
+		: open(node.path.c_str(), O_RDONLY | O_DIRECTORY);
+	releaseDirFd(task->parent);
+	task->parent = NULL;
+	if (fd < 0)
+	{
+		fprintf(stderr, "Failed to open directory %s!\n", node.path.c_str());
+		return 1;
+	}
+	if (listDir(fd, node, ctx->whiteouts) != 0)
 	{
-		// 1-byte sequence
-		*out = code1;
+		close(fd);
 		return 1;
-	} else if (code1 < 0xC2)
-		return -1;
-	else if (code1 < 0xE0)
+	}
+
+	u32 subDirs = 0;
+	for (std::vector<romfs_scan_ent_t>::iterator it = node.entries.begin(); it != node.entries.end(); ++it)
+		if (it->dir) subDirs ++;
+	scan_dir_fd_t* shared = NULL;
+	if (subDirs)
 	{
-		// 2-byte sequence
-		code2 = *in++;
-		if ((code2 & 0xC0) != 0x80)
-			return -1;
+		shared = new scan_dir_fd_t;
+		shared->fd = fd;
+		shared->refs = subDirs;
+	} else
+		close(fd);
+#endif
+
+	if (ctx->sort)
+		sortEntries(node.entries);
 
-		*out = (code1 << 6) + code2 - 0x3080;
-		return 2;
-	} else if (code1 < 0xF0)
+	// Only hand out the subdirectories once the listing is complete, the
+	// entries vector must not be resized while other threads fill them in
+	for (std::vector<romfs_scan_ent_t>::iterator it = node.entries.begin(); it != node.entries.end(); ++it)
 	{
-		/* 3-byte sequence */
-		code2 = *in++;
-		if ((code2 & 0xC0) != 0x80)
-			return -1;
-		if (code1 == 0xE0 && code2 < 0xA0)
-			return -1;
+		if (!it->dir) continue;
+		scan_task_t* sub = new scan_task_t;
+		sub->ctx = ctx;
+		sub->node = it->dir;
+#ifndef WIN32
+		sub->parent = shared;
+		sub->name = it->name.c_str();
+#endif
+		ctx->pool->Submit(scanDirTask, sub, &ctx->group);
+	}
 
-		code3 = *in++;
-		if ((code3 & 0xC0) != 0x80)
-			return -1;
+	return 0;
+}
 
-		*out = (code1 << 12) + (code2 << 6) + code3 - 0xE2080;
-		return 3;
-	} else if(code1 < 0xF5)
+static void scanDirTask(void* arg)
+{
+	scan_task_t* task = (scan_task_t*)arg;
+	scan_ctx_t* ctx = task->ctx;
+	if (!ctx->failed.IsSet())
 	{
-		// 4-byte sequence
-		code2 = *in++;
-		if ((code2 & 0xC0) != 0x80)
-			return -1;
-		if (code1 == 0xF0 && code2 < 0x90)
-			return -1;
-		if (code1 == 0xF4 && code2 >= 0x90)
-			return -1;
+		if (ctx->io) ctx->io->Acquire();
+		if (scanDirNode(task) != 0)
+			ctx->failed.Set();
+		if (ctx->io) ctx->io->Release();
+	}
+#ifndef WIN32
+	releaseDirFd(task->parent); // Skipped after a failure
+#endif
+	delete task;
+}
 
-		code3 = *in++;
-		if ((code3 & 0xC0) != 0x80)
-			return -1;
+int RomFS::ScanTree(romfs_scan_dir_t& root)
+{
+	scan_ctx_t ctx;
+	ctx.pool = &Pool();
+	ctx.io = opts.ioLimit;
+	ctx.sort = opts.sort;
+	ctx.whiteouts = opts.base != NULL;
+
+	scan_task_t* task = new scan_task_t;
+	task->ctx = &ctx;
+	task->node = &root;
+#ifndef WIN32
+	task->parent = NULL;
+	task->name = NULL;
+#endif
+	ctx.pool->Submit(scanDirTask, task, &ctx.group);
+	ctx.pool->Wait(&ctx.group);
 
-		code4 = *in++;
-		if ((code4 & 0xC0) != 0x80)
-			return -1;
+	return ctx.failed.IsSet() ? 1 : 0;
+}
 
-		*out = (code1 << 18) + (code2 << 12) + (code3 << 6) + code4 - 0x3C82080;
-		return 4;
+// Points tree at the copy of its directory another build has scanned
+// already, or scans it and shares the result
+int RomFS::ScanCached(romfs_scan_dir_t*& tree)
+{
+	romfs_scan_dir_t* shared;
+	if (opts.scanCache->Get(tree->path, shared))
+	{
+		tree = shared;
+		return 0;
 	}
 
-	return -1;
+	shared = new romfs_scan_dir_t(tree->path);
+	int rc = ScanTree(*shared);
+	if (rc != 0)
+	{
+		delete shared;
+		shared = NULL;
+	}
+	opts.scanCache->Put(tree->path, shared);
+	if (shared) tree = shared;
+	return rc;
 }
-#endif
 
-static void setStr(romfs_str& rstr, const oschar_t* ostr)
+// Builds sharing a directory may name it differently
+static osstring cacheKey(const osstring& path)
 {
 #ifdef WIN32
-	u32 strsize = osstrlen(ostr);
-	rstr = romfs_str(ostr, ostr+strsize);
+	WCHAR buf[OSPATHLEN];
+	DWORD len = GetFullPathNameW(path.c_str(), OSPATHLEN, buf, NULL);
+	return len && len < OSPATHLEN ? osstring(buf, len) : path;
 #else
-	// We need to convert the UTF-8 input into UTF-16
-	rstr.clear();
-	for (;;)
-	{
-		uint32_t code = 0;
-		ssize_t units = decode_utf8(&code, (const uint8_t*)ostr);
-		if (units == -1)
-		{
-			rstr.push_back(0xFFFD); // Replacement character
-			ostr++;
-			continue;
-		}
-		if (code == 0)
-			break;
+	char buf[PATH_MAX];
+	return realpath(path.c_str(), buf) ? osstring(buf) : path;
+#endif
+}
 
-		// Encode Unicode codepoint as UTF-16
-		if (code < 0x10000)
-			rstr.push_back(code);
-		else if (code < 0x110000)
-		{
-			rstr.push_back((code >> 10) + 0xD7C0);
-			rstr.push_back((code & 0x3FF) + 0xDC00);
-		} else
-			rstr.push_back(0xFFFD); // Replacement character
+ScanCache::ScanCache() : trees()
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
 
-		ostr += units;
-	}
-#endif
+ScanCache::~ScanCache()
+{
+	for (std::map<osstring, romfs_scan_dir_t*>::iterator it = trees.begin(); it != trees.end(); ++it)
+		delete it->second;
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
 }
 
-romfs_dir_t& RomFS::AddDir(romfs_dir_t* parent, const oschar_t* name)
+bool ScanCache::Get(const osstring& path, romfs_scan_dir_t*& tree)
 {
-	dirs.push_back(romfs_dir_t());
-	romfs_dir_t& dir = dirs.back();
-	dir.offset = dirOff;
-	dir.parent = parent ? parent : &dir;
-	if (name)
-		setStr(dir.name, name);
-	dirOff += 0x18 + dir.name.size()*2;
-	dirOff = (dirOff + 3) &~ 3;
-	return dir;
+	osstring key = cacheKey(path);
+	pthread_mutex_lock(&lock);
+	std::map<osstring, romfs_scan_dir_t*>::iterator it;
+	while ((it = trees.find(key)) != trees.end() && !it->second)
+		pthread_cond_wait(&cond, &lock);
+	bool found = it != trees.end();
+	if (found)
+		tree = it->second;
+	else
+		trees[key] = NULL; // Ours to scan
+	pthread_mutex_unlock(&lock);
+	return found;
 }
 
-romfs_file_t& RomFS::AddFile(romfs_dir_t* parent, const oschar_t* name)
+void ScanCache::Put(const osstring& path, romfs_scan_dir_t* tree)
 {
-	files.push_back(romfs_file_t(parent));
-	romfs_file_t& file = files.back();
-	file.offset = fileOff;
-	setStr(file.name, name);
-	fileOff += 0x20 + file.name.size()*2;
-	fileOff = (fileOff + 3) &~ 3;
-	return file;
+	osstring key = cacheKey(path);
+	pthread_mutex_lock(&lock);
+	// After a failure the next build asking for the directory tries again
+	if (tree)
+		trees[key] = tree;
+	else
+		trees.erase(key);
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+// Converts UTF-8 text from a file list to a host string
+static bool toOsString(osstring& out, const char* str, size_t len)
+{
+#ifdef WIN32
+	out.clear();
+	if (!len) return true;
+	int count = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, str, len, NULL, 0);
+	if (count <= 0) return false;
+	out.resize(count);
+	return MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, str, len, &out[0], count) == count;
+#else
+	out.assign(str, len);
+	return true;
+#endif
+}
+
+static bool isAbsolutePath(const osstring& path)
+{
+#ifdef WIN32
+	return (path.size() > 0 && (path[0] == '\\' || path[0] == '/')) || (path.size() > 1 && path[1] == ':');
+#else
+	return path.size() > 0 && path[0] == '/';
+#endif
+}
+
+// Looks up the size and identity of a single host file, for entries that
+// come without a precomputed size
+static bool statHostFile(const osstring& path, romfs_scan_ent_t& ent)
+{
+#ifdef WIN32
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &fad) || (fad.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		return false;
+	ent.size = (u64)fad.nFileSizeLow | ((u64)fad.nFileSizeHigh << 32);
+	ent.mtime = (u64)fad.ftLastWriteTime.dwLowDateTime | ((u64)fad.ftLastWriteTime.dwHighDateTime << 32);
+#else
+	struct stat statbuf;
+	if (stat(path.c_str(), &statbuf) < 0 || S_ISDIR(statbuf.st_mode))
+		return false;
+	ent.size = statbuf.st_size;
+#ifdef __APPLE__
+	ent.mtime = (u64)statbuf.st_mtimespec.tv_sec*1000000000 + statbuf.st_mtimespec.tv_nsec;
+#else
+	ent.mtime = (u64)statbuf.st_mtim.tv_sec*1000000000 + statbuf.st_mtim.tv_nsec;
+#endif
+	ent.inode = statbuf.st_ino;
+	ent.device = statbuf.st_dev;
+#endif
+	return true;
+}
+
+static void sortTree(romfs_scan_dir_t& root)
+{
+	std::vector<romfs_scan_dir_t*> pending(1, &root);
+	while (!pending.empty())
+	{
+		romfs_scan_dir_t* node = pending.back();
+		pending.pop_back();
+		sortEntries(node->entries);
+		for (std::vector<romfs_scan_ent_t>::iterator it = node->entries.begin(); it != node->entries.end(); ++it)
+			if (it->dir)
+				pending.push_back(it->dir);
+	}
+}
+
+typedef std::map<std::pair<romfs_scan_dir_t*, osstring>, size_t> list_index_t;
+
+// Adds an entry of a file list below root, creating the directories on
+// its path as needed. file is NULL for a directory.
+static const char* addListEntry(romfs_scan_dir_t& root, list_index_t& index, const std::string& path, romfs_scan_ent_t* file)
+{
+	romfs_scan_dir_t* node = &root;
+	osstring name;
+	const char* p = path.c_str();
+	while (*p == '/') p ++;
+	if (!*p && file) return "Invalid path";
+
+	while (*p)
+	{
+		size_t len = strcspn(p, "/");
+		if ((len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.') || !toOsString(name, p, len))
+			return "Invalid path";
+		p += len;
+		while (*p == '/') p ++;
+
+		list_index_t::iterator it = index.find(std::make_pair(node, name));
+		if (!*p && file)
+		{
+			if (it != index.end()) return "Duplicate path";
+			index[std::make_pair(node, name)] = node->entries.size();
+			node->entries.push_back(*file);
+			node->entries.back().name = name;
+			return NULL;
+		}
+
+		if (it == index.end())
+		{
+			index[std::make_pair(node, name)] = node->entries.size();
+			romfs_scan_ent_t ent;
+			ent.name = name;
+			ent.dir = new romfs_scan_dir_t(osstring());
+			node->entries.push_back(ent);
+			node = ent.dir;
+		} else if (node->entries[it->second].dir)
+			node = node->entries[it->second].dir;
+		else
+			return "Path is both a file and a directory";
+	}
+	return NULL;
+}
+
+// Builds the tree from a file list instead of listing host directories.
+// Every line holds an image path, a tab, the host file to take its
+// contents from and optionally another tab and the size of that file.
+// Lines with only a path declare a directory, parents are created as
+// needed. Host files are only looked at here when their size is missing,
+// otherwise nothing touches them until the data gets written.
+int RomFS::LoadFileList(romfs_scan_dir_t& root)
+{
+	FILE* f = fopen(opts.fileList, "r");
+	if (!f) die("Cannot open file list");
+
+	list_index_t index;
+	const char* error = NULL;
+	u32 lineNo = 0, numFiles = 0, numStat = 0;
+	char buf[4096];
+	std::string line;
+	while (!error && fgets(buf, sizeof(buf), f))
+	{
+		line += buf;
+		if (line[line.size()-1] != '\n' && !feof(f))
+			continue;
+		lineNo ++;
+		while (!line.empty() && (line[line.size()-1] == '\n' || line[line.size()-1] == '\r'))
+			line.erase(line.size()-1);
+		if (line.empty() || line[0] == '#')
+		{
+			line.clear();
+			continue;
+		}
+
+		size_t tab = line.find('\t');
+		if (tab == std::string::npos)
+			error = addListEntry(root, index, line, NULL);
+		else
+		{
+			std::string host = line.substr(tab + 1);
+			size_t sizeTab = host.find('\t');
+			romfs_scan_ent_t ent;
+			if (sizeTab != std::string::npos)
+			{
+				const char* size = host.c_str() + sizeTab + 1;
+				char* end;
+				ent.size = strtoull(size, &end, 0);
+				if (end == size || *end) error = "Invalid size";
+				host.erase(sizeTab);
+			}
+
+			if (!error && (host.empty() || !toOsString(ent.hostPath, host.c_str(), host.size())))
+				error = "Invalid host path";
+			if (!error && !isAbsolutePath(ent.hostPath) && !root.path.empty())
+				ent.hostPath = root.path + OSWILDCARD[0] + ent.hostPath;
+			if (!error && sizeTab == std::string::npos)
+			{
+				numStat ++;
+				if (!statHostFile(ent.hostPath, ent)) error = "Cannot stat host file";
+			}
+			if (!error)
+				error = addListEntry(root, index, line.substr(0, tab), &ent);
+			if (!error)
+				numFiles ++;
+		}
+
+		if (error)
+			fprintf(stderr, "%s in file list line %u: %s\n", error, lineNo, line.c_str());
+		line.clear();
+	}
+	fclose(f);
+	if (error) return 1;
+
+	if (opts.sort)
+		sortTree(root);
+
+	printf("Read %u files from the file list", numFiles);
+	if (numStat)
+		printf(", %u of them without a size", numStat);
+	printf("\n");
+	return 0;
+}
+
+// Converts a name as stored in an image to a host string
+static osstring imageName(const u8* name, u32 len)
+{
+#ifdef WIN32
+	osstring out(len, 0);
+	for (u32 i = 0; i < len; i ++)
+		out[i] = name[i*2] | name[i*2+1] << 8;
+	return out;
+#else
+	std::string out;
+	romfsNameToUtf8(out, name, len);
+	return out;
+#endif
+}
+
+static bool isWhiteout(const osstring& name)
+{
+	return name.size() > WHITEOUT_LEN && name.compare(0, WHITEOUT_LEN, WHITEOUT) == 0;
+}
+
+// Drops the deletion markers from an overlay directory that has no
+// counterpart in the base image, there is nothing for them to delete
+static void stripWhiteouts(romfs_scan_dir_t& root)
+{
+	std::vector<romfs_scan_dir_t*> pending(1, &root);
+	while (!pending.empty())
+	{
+		std::vector<romfs_scan_ent_t>& entries = pending.back()->entries;
+		pending.pop_back();
+		size_t kept = 0;
+		for (size_t i = 0; i < entries.size(); i ++)
+		{
+			if (isWhiteout(entries[i].name))
+			{
+				delete entries[i].dir;
+				continue;
+			}
+			if (entries[i].dir)
+				pending.push_back(entries[i].dir);
+			if (kept != i)
+				entries[kept] = entries[i];
+			kept ++;
+		}
+		entries.resize(kept);
+	}
+}
+
+struct overlay_stats_t
+{
+	u32 added, replaced, removed;
+};
+
+// Moves the entries of an overlay into the base tree. Files replace the
+// entry of the same name, directories are merged with the directory of the
+// same name, and an entry named .wh.NAME removes NAME.
+static void applyOverlay(romfs_scan_dir_t& baseRoot, romfs_scan_dir_t& overlayRoot, overlay_stats_t& stats)
+{
+	typedef std::pair<romfs_scan_dir_t*, romfs_scan_dir_t*> dir_pair;
+	std::vector<dir_pair> pending(1, dir_pair(&baseRoot, &overlayRoot));
+	while (!pending.empty())
+	{
+		romfs_scan_dir_t& base = *pending.back().first;
+		romfs_scan_dir_t& overlay = *pending.back().second;
+		pending.pop_back();
+
+		std::map<osstring, size_t> index;
+		for (size_t i = 0; i < base.entries.size(); i ++)
+			index[base.entries[i].name] = i;
+		std::vector<bool> removed(base.entries.size(), false);
+
+		// Deletions go first, so that a directory can be replaced by a fresh one
+		std::vector<romfs_scan_ent_t>::iterator ent;
+		for (ent = overlay.entries.begin(); ent != overlay.entries.end(); ++ent)
+		{
+			if (!isWhiteout(ent->name)) continue;
+			std::map<osstring, size_t>::iterator it = index.find(ent->name.substr(WHITEOUT_LEN));
+			if (it != index.end() && !removed[it->second])
+			{
+				removed[it->second] = true;
+				stats.removed ++;
+			}
+		}
+
+		for (ent = overlay.entries.begin(); ent != overlay.entries.end(); ++ent)
+		{
+			if (isWhiteout(ent->name)) continue;
+			std::map<osstring, size_t>::iterator it = index.find(ent->name);
+			bool exists = it != index.end() && !removed[it->second];
+			if (exists && ent->dir && base.entries[it->second].dir)
+			{
+				pending.push_back(dir_pair(base.entries[it->second].dir, ent->dir));
+				continue;
+			}
+
+			// Files moved into a directory of the base need their full host path
+			if (ent->dir)
+				stripWhiteouts(*ent->dir);
+			else if (ent->hostPath.empty())
+				ent->hostPath = overlay.path + OSWILDCARD[0] + ent->name;
+
+			if (exists)
+			{
+				romfs_scan_ent_t& old = base.entries[it->second];
+				delete old.dir;
+				old = *ent;
+				stats.replaced ++;
+			} else
+			{
+				base.entries.push_back(*ent);
+				stats.added ++;
+			}
+			ent->dir = NULL; // Belongs to the base tree now
+		}
+
+		size_t kept = 0;
+		for (size_t i = 0; i < base.entries.size(); i ++)
+		{
+			if (i < removed.size() && removed[i])
+			{
+				delete base.entries[i].dir;
+				continue;
+			}
+			if (kept != i)
+				base.entries[kept] = base.entries[i];
+			kept ++;
+		}
+		base.entries.resize(kept);
+	}
+}
+
+// Turns the tree of the base image into a scanned tree whose files refer
+// to their data within the image, and lays the overlay over it. Only the
+// overlay's own files are read from disk later, everything else is copied
+// out of the base image by range.
+int RomFS::LoadBase(romfs_scan_dir_t& root, romfs_scan_dir_t& overlay)
+{
+#ifdef WIN32
+	WCHAR path[OSPATHLEN];
+	if (!MultiByteToWideChar(CP_ACP, 0, opts.base, -1, path, OSPATHLEN))
+		die("Cannot convert to Unicode");
+#else
+	const char* path = opts.base;
+#endif
+	RomFSReader reader;
+	safe_call(reader.Open(path));
+	u64 dataPos = reader.FileOffset() + reader.DataOffset();
+
+	u32 numDirs = 0, numFiles = 0;
+	std::vector< std::pair<u32, romfs_scan_dir_t*> > pending(1, std::make_pair(0u, &root));
+	while (!pending.empty())
+	{
+		u32 off = pending.back().first;
+		romfs_scan_dir_t* node = pending.back().second;
+		pending.pop_back();
+
+		romfs_dir_info_t dir;
+		safe_call(reader.GetDir(off, dir));
+
+		for (u32 child = dir.firstSubDir; child != ROMFS_NONE; )
+		{
+			romfs_dir_info_t sub;
+			safe_call(reader.GetDir(child, sub));
+			romfs_scan_ent_t ent;
+			ent.name = imageName(sub.name, sub.nameLen);
+			ent.dir = new romfs_scan_dir_t(osstring());
+			node->entries.push_back(ent);
+			pending.push_back(std::make_pair(child, ent.dir));
+			if (++numDirs > reader.MaxDirs()) die("Corrupted RomFS image");
+			child = sub.sibling;
+		}
+
+		for (u32 child = dir.firstFile; child != ROMFS_NONE; )
+		{
+			romfs_file_info_t file;
+			safe_call(reader.GetFile(child, file));
+			romfs_scan_ent_t ent;
+			ent.name = imageName(file.name, file.nameLen);
+			ent.hostPath = path;
+			ent.hostOff = dataPos + file.dataOff;
+			ent.size = file.dataSize;
+			node->entries.push_back(ent);
+			if (++numFiles > reader.MaxFiles()) die("Corrupted RomFS image");
+			child = file.sibling;
+		}
+
+		// Sibling chains run backwards from the order the entries were added in
+		std::reverse(node->entries.begin(), node->entries.end());
+	}
+
+	overlay_stats_t stats = { 0, 0, 0 };
+	applyOverlay(root, overlay, stats);
+	if (opts.sort)
+		sortTree(root);
+
+	printf("Base image holds %u files, the overlay added %u entries, replaced %u and removed %u\n",
+		numFiles, stats.added, stats.replaced, stats.removed);
+	return 0;
+}
+
+static void countTree(romfs_scan_dir_t& root, size_t& numDirs, size_t& numFiles, size_t& nameLen, size_t& pathLen)
+{
+	std::vector<romfs_scan_dir_t*> pending(1, &root);
+	while (!pending.empty())
+	{
+		romfs_scan_dir_t& node = *pending.back();
+		pending.pop_back();
+		for (std::vector<romfs_scan_ent_t>::iterator it = node.entries.begin(); it != node.entries.end(); ++it)
+		{
+			// A name never takes more UTF-16 units than it has host characters
+			nameLen += it->name.size();
+			if (it->dir)
+			{
+				numDirs ++;
+				pending.push_back(it->dir);
+			} else
+			{
+				numFiles ++;
+				if (it->hostPath.empty())
+					pathLen += node.path.size() + it->name.size() + 2;
+				else
+					pathLen += it->hostPath.size() + 1;
+			}
+		}
+	}
+}
+
+// Sizes the entry tables and pools for the whole scanned tree up front, so
+// that adding the entries never has to grow them
+void RomFS::ReserveTree(romfs_scan_dir_t& root)
+{
+	size_t numDirs = dirs.size(), numFiles = files.size();
+	size_t nameLen = names.size(), pathLen = hostPaths.size();
+	countTree(root, numDirs, numFiles, nameLen, pathLen);
+	dirs.reserve(numDirs);
+	files.reserve(numFiles);
+	hosts.reserve(numFiles);
+	names.reserve(nameLen);
+	hostPaths.reserve(pathLen);
+}
+
+struct tree_level_t
+{
+	u32 dir;
+	romfs_scan_dir_t* node;
+	size_t pos; // Next entry to add
+};
+
+// Replays a scanned tree in depth-first order, which assigns exactly the
+// same entry offsets as walking the host directories serially. The walk
+// keeps its own stack of open directories instead of recursing.
+void RomFS::AddTree(u32 root, romfs_scan_dir_t& rootNode)
+{
+	std::vector<tree_level_t> stack;
+	tree_level_t top = { root, &rootNode, 0 };
+	stack.push_back(top);
+
+	while (!stack.empty())
+	{
+		tree_level_t& level = stack.back();
+		if (level.pos == level.node->entries.size())
+		{
+			stack.pop_back();
+			continue;
+		}
+
+		u32 dir = level.dir;
+		romfs_scan_dir_t& node = *level.node;
+		romfs_scan_ent_t& ent = node.entries[level.pos++];
+		if (ent.dir)
+		{
+			u32 child = AddDir(dir, ent.name.c_str());
+			dirs[child].sibling = dirs[dir].firstSubDir;
+			dirs[dir].firstSubDir = child;
+			tree_level_t sub = { child, ent.dir, 0 };
+			stack.push_back(sub); // Invalidates level
+		} else
+		{
+			u32 child = AddFile(dir, ent.name.c_str());
+			files[child].sibling = dirs[dir].firstFile;
+			dirs[dir].firstFile = child;
+			files[child].dataSize = ent.size;
+
+			romfs_host_t& host = hosts[child];
+			if (ent.hostPath.empty())
+				host.pathOff = AddHostPath(node.path, ent.name.c_str());
+			else
+				host.pathOff = AddHostPath(ent.hostPath, NULL);
+			host.hostOff = ent.hostOff;
+			host.mtime = ent.mtime;
+			host.inode = ent.inode;
+			host.device = ent.device;
+		}
+	}
+}
+
+struct hash_task_t
+{
+	const oschar_t* path;
+	u64 offset, size;
+	u8* hash;
+	size_t bufSize;
+	IoLimit* io;
+	FailFlag* failed;
+};
+
+static void hashFileTask(void* arg)
+{
+	hash_task_t* task = (hash_task_t*)arg;
+
+	FILE* f = osfopen(task->path, "rb");
+	bool rc = f != NULL;
+	if (rc && task->offset)
+		rc = fseek64(f, task->offset, SEEK_SET) == 0;
+
+	sha256_ctx ctx;
+	sha256_init(&ctx);
+	std::vector<u8> buf(task->bufSize);
+	for (u64 remaining = task->size; rc && remaining; )
+	{
+		size_t size = remaining < buf.size() ? (size_t)remaining : buf.size();
+		if (task->io) task->io->Acquire();
+		rc = fread(&buf.front(), 1, size, f) == size;
+		if (task->io) task->io->Release();
+		sha256_update(&ctx, &buf.front(), size);
+		remaining -= size;
+	}
+	sha256_final(&ctx, task->hash);
+	if (f) fclose(f);
+
+	if (!rc)
+	{
+#ifdef WIN32
+		fwprintf(stderr, L"Could not read file %ls!\n", task->path);
+#else
+		fprintf(stderr, "Could not read file %s!\n", task->path);
+#endif
+		task->failed->Set();
+	}
+}
+
+int RomFS::HashFiles(const std::vector<u32>& list, u8* hashes)
+{
+	if (list.empty()) return 0;
+
+	std::vector<hash_task_t> tasks(list.size());
+	FailFlag failed;
+	ThreadPool& pool = Pool();
+	TaskGroup group;
+	size_t bufSize = CopyBufSize(pool.NumExecutors());
+	for (size_t i = 0; i < list.size(); i ++)
+	{
+		tasks[i].bufSize = bufSize;
+		tasks[i].io = opts.ioLimit;
+		tasks[i].path = HostPath(list[i]);
+		tasks[i].offset = hosts[list[i]].hostOff;
+		tasks[i].size = files[list[i]].dataSize;
+		tasks[i].hash = hashes + i*SHA256_HASH_SIZE;
+		tasks[i].failed = &failed;
+		pool.Submit(hashFileTask, &tasks[i], &group);
+	}
+	pool.Wait(&group);
+
+	return failed.IsSet() ? 1 : 0;
+}
+
+// Creates the temporary file compressed data is collected in
+static FILE* createSpool(osstring& path)
+{
+#ifdef WIN32
+	WCHAR dir[OSPATHLEN], name[OSPATHLEN];
+	if (!GetTempPathW(OSPATHLEN, dir) || !GetTempFileNameW(dir, L"rfs", 0, name))
+		return NULL;
+	path = name;
+	return _wfopen(name, L"wb");
+#else
+	const char* dir = getenv("TMPDIR");
+	std::string name = std::string(dir && *dir ? dir : "/tmp") + "/mkromfs3ds-XXXXXX";
+	int fd = mkstemp(&name[0]);
+	if (fd < 0) return NULL;
+	path = name;
+	FILE* f = fdopen(fd, "wb");
+	if (!f) close(fd);
+	return f;
+#endif
+}
+
+// Every task streams its compressed file to the end of a spool no other
+// task is writing to, so that the file ends up in one piece. There are as
+// many spools as tasks ever ran at once.
+struct lz11_spool_t
+{
+	FILE* f;
+	u64 size;
+	u32 index;
+};
+
+struct lz11_ctx_t
+{
+	std::vector<lz11_spool_t*> spools, idle;
+	std::vector<osstring>* paths;
+	pthread_mutex_t lock; // Guards the spool lists
+	size_t bufSize;
+	IoLimit* io;
+	FailFlag failed;
+};
+
+struct lz11_task_t
+{
+	lz11_ctx_t* ctx;
+	const oschar_t* path;
+	u64 offset, size;
+	u32 spool; // Where the compressed data ended up
+	u64 spoolOff, spoolSize;
+};
+
+static void compressError(const char* msg, const oschar_t* path)
+{
+#ifdef WIN32
+	fwprintf(stderr, L"%hs %ls!\n", msg, path);
+#else
+	fprintf(stderr, "%s %s!\n", msg, path);
+#endif
+}
+
+static lz11_spool_t* claimSpool(lz11_ctx_t* ctx)
+{
+	pthread_mutex_lock(&ctx->lock);
+	lz11_spool_t* spool = NULL;
+	if (!ctx->idle.empty())
+	{
+		spool = ctx->idle.back();
+		ctx->idle.pop_back();
+	} else
+	{
+		osstring path;
+		FILE* f = createSpool(path);
+		if (f)
+		{
+			spool = new lz11_spool_t;
+			spool->f = f;
+			spool->size = 0;
+			spool->index = ctx->spools.size();
+			ctx->spools.push_back(spool);
+			ctx->paths->push_back(path);
+		}
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return spool;
+}
+
+static void releaseSpool(lz11_ctx_t* ctx, lz11_spool_t* spool)
+{
+	pthread_mutex_lock(&ctx->lock);
+	ctx->idle.push_back(spool);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+// Writes out the compressed data that is final so far
+static bool drainEncoder(lz11_ctx_t* ctx, lz11_spool_t* spool, LZ11Encoder& enc)
+{
+	size_t size = enc.Ready();
+	if (!size) return true;
+	if (ctx->io) ctx->io->Acquire();
+	bool rc = fwrite(enc.Output(), 1, size, spool->f) == size;
+	if (ctx->io) ctx->io->Release();
+	spool->size += size;
+	enc.Drain();
+	return rc;
+}
+
+static void compressTask(void* arg)
+{
+	lz11_task_t* task = (lz11_task_t*)arg;
+	lz11_ctx_t* ctx = task->ctx;
+	if (ctx->failed.IsSet()) return;
+
+	if (task->size > LZ11_MAX_SIZE)
+	{
+		compressError("File is too large for LZ11:", task->path);
+		ctx->failed.Set();
+		return;
+	}
+
+	lz11_spool_t* spool = claimSpool(ctx);
+	if (!spool)
+	{
+		fputs("Could not create a temporary file\n", stderr);
+		ctx->failed.Set();
+		return;
+	}
+	task->spool = spool->index;
+	task->spoolOff = spool->size;
+
+	// The file streams through a chunk at a time, the encoder only holds on
+	// to the part matches can still reach
+	std::vector<u8> in(ctx->bufSize);
+	LZ11Encoder enc(task->size);
+	if (ctx->io) ctx->io->Acquire();
+	FILE* f = osfopen(task->path, "rb");
+	bool readOk = f != NULL && (!task->offset || fseek64(f, task->offset, SEEK_SET) == 0);
+	if (ctx->io) ctx->io->Release();
+	bool writeOk = true;
+	for (u64 done = 0; readOk && writeOk && done < task->size; )
+	{
+		size_t count = task->size - done < in.size() ? (size_t)(task->size - done) : in.size();
+		if (ctx->io) ctx->io->Acquire();
+		readOk = fread(&in.front(), 1, count, f) == count;
+		if (ctx->io) ctx->io->Release();
+		if (!readOk) break;
+		enc.Update(&in.front(), count);
+		writeOk = drainEncoder(ctx, spool, enc);
+		done += count;
+	}
+	if (f) fclose(f);
+	if (readOk && writeOk)
+	{
+		enc.Finish();
+		writeOk = drainEncoder(ctx, spool, enc);
+	}
+	task->spoolSize = spool->size - task->spoolOff;
+	releaseSpool(ctx, spool);
+
+	if (!readOk)
+		compressError("Could not read file", task->path);
+	else if (!writeOk)
+		fputs("Could not write temporary file\n", stderr);
+	if (!readOk || !writeOk)
+		ctx->failed.Set();
+}
+
+// Stores the files with one of the LZ11 extensions compressed. Their final
+// size is needed for the layout, so they are all compressed up front, in
+// parallel. The results are collected in temporary spool files, which then
+// stand in as their host files for everything that follows.
+int RomFS::CompressFiles(void)
+{
+	std::vector<u32> list;
+	for (u32 i = 0; i < files.size(); i ++)
+		if (lz11_match_ext(opts.lz11, Name(files[i]), files[i].nameLen))
+			list.push_back(i);
+	if (list.empty()) return 0;
+
+	// A task holds its input chunk, the encoder's copy of it and the output
+	// of about the same size, within the buffer a copying thread gets
+	ThreadPool& pool = Pool();
+	lz11_ctx_t ctx;
+	ctx.paths = &spoolPaths;
+	ctx.bufSize = CopyBufSize(pool.NumExecutors()) / 4;
+	ctx.io = opts.ioLimit;
+	pthread_mutex_init(&ctx.lock, NULL);
+
+	std::vector<lz11_task_t> tasks(list.size());
+	TaskGroup group;
+	for (size_t i = 0; i < list.size(); i ++)
+	{
+		tasks[i].ctx = &ctx;
+		tasks[i].path = HostPath(list[i]);
+		tasks[i].offset = hosts[list[i]].hostOff;
+		tasks[i].size = files[list[i]].dataSize;
+		tasks[i].spool = 0;
+		tasks[i].spoolOff = tasks[i].spoolSize = 0;
+		pool.Submit(compressTask, &tasks[i], &group);
+	}
+	pool.Wait(&group);
+
+	bool closed = true;
+	for (size_t i = 0; i < ctx.spools.size(); i ++)
+	{
+		closed = fclose(ctx.spools[i]->f) == 0 && closed;
+		delete ctx.spools[i];
+	}
+	pthread_mutex_destroy(&ctx.lock);
+	if (ctx.failed.IsSet()) return 1;
+	if (!closed) die("Could not write temporary file");
+
+	// The modification time stays that of the source, which is what decides
+	// whether the compressed data can have changed. The inode goes, hard
+	// links to a compressed file no longer say anything about the data.
+	std::vector<size_t> spoolPathOffs;
+	for (size_t i = 0; i < spoolPaths.size(); i ++)
+		spoolPathOffs.push_back(AddHostPath(spoolPaths[i], NULL));
+	u64 inTotal = 0, outTotal = 0;
+	for (size_t i = 0; i < list.size(); i ++)
+	{
+		u32 file = list[i];
+		inTotal += files[file].dataSize;
+		outTotal += tasks[i].spoolSize;
+		files[file].dataSize = tasks[i].spoolSize;
+		hosts[file].pathOff = spoolPathOffs[tasks[i].spool];
+		hosts[file].hostOff = tasks[i].spoolOff;
+		hosts[file].inode = hosts[file].device = 0;
+	}
+
+	printf("Compressed %u files with LZ11, %llu bytes down to %llu\n", (u32)list.size(),
+		(unsigned long long)inTotal, (unsigned long long)outTotal);
+	return 0;
+}
+
+// Makes files with identical contents share a single copy of the data.
+// Only files of the same size can match: hard links are recognised by
+// their inode without reading anything, the rest is compared by SHA-256.
+// The first file in table order always owns the data.
+int RomFS::Dedupe(void)
+{
+	typedef std::pair<u64, u64> inode_key;
+	std::map<inode_key, u32> byInode;
+	std::map<u64, u32> sizeCount;
+
+	for (u32 i = 0; i < files.size(); i ++)
+	{
+		romfs_file_t& file = files[i];
+		if (!file.dataSize) continue;
+		if (hosts[i].inode)
+		{
+			std::pair<std::map<inode_key, u32>::iterator, bool> ins =
+				byInode.insert(std::make_pair(inode_key(hosts[i].device, hosts[i].inode), i));
+			if (!ins.second)
+			{
+				file.dataOwner = ins.first->second;
+				continue;
+			}
+		}
+		sizeCount[file.dataSize] ++;
+	}
+
+	std::vector<u32> toHash;
+	for (u32 i = 0; i < files.size(); i ++)
+		if (files[i].dataSize && files[i].dataOwner == ROMFS_NONE && sizeCount[files[i].dataSize] > 1)
+			toHash.push_back(i);
+
+	std::vector<u8> hashes(toHash.size() * SHA256_HASH_SIZE);
+	if (toHash.size())
+		safe_call(HashFiles(toHash, &hashes.front()));
+
+	typedef std::pair<u64, std::string> content_key;
+	std::map<content_key, u32> byContent;
+	for (size_t i = 0; i < toHash.size(); i ++)
+	{
+		content_key key(files[toHash[i]].dataSize, std::string((const char*)&hashes[i*SHA256_HASH_SIZE], SHA256_HASH_SIZE));
+		std::pair<std::map<content_key, u32>::iterator, bool> ins =
+			byContent.insert(std::make_pair(key, toHash[i]));
+		if (!ins.second)
+			files[toHash[i]].dataOwner = ins.first->second;
+	}
+
+	u32 shared = 0;
+	u64 saved = 0;
+	for (std::vector<romfs_file_t>::iterator it = files.begin(); it != files.end(); ++it)
+		if (it->dataOwner != ROMFS_NONE)
+		{
+			shared ++;
+			saved += it->dataSize;
+		}
+	if (shared)
+		printf("Deduplicated %u files, saving %llu bytes\n", shared, (unsigned long long)saved);
+
+	return 0;
+}
+
+// Strips the line ending and makes the path absolute. Returns false for
+// blank lines and comments.
+static bool tracePath(std::string& path)
+{
+	size_t end = path.find_last_not_of(" \t\r\n");
+	path.erase(end == std::string::npos ? 0 : end + 1);
+	if (path.empty() || path[0] == '#')
+		return false;
+	if (path[0] != '/')
+		path.insert(0, "/");
+	return true;
+}
+
+// Decides in which order the file data is stored. By default that is table
+// order. With an access trace the files are stored in the order they were
+// first read, followed by everything the trace does not mention, so that
+// loading them turns into sequential reads.
+int RomFS::OrderData(void)
+{
+	dataOrder.clear();
+	dataOrder.reserve(files.size());
+	std::vector<bool> placed(files.size(), false);
+	tracedFiles = 0;
+
+	if (opts.traceFile)
+	{
+		FILE* f = fopen(opts.traceFile, "r");
+		if (!f) die("Cannot open access trace");
+
+		std::vector<std::string> dirPaths, filePaths;
+		GetPaths(dirPaths, filePaths);
+		std::map<std::string, u32> byPath;
+		for (u32 i = 0; i < filePaths.size(); i ++)
+			byPath[filePaths[i]] = i;
+
+		u32 traced = 0, unknown = 0;
+		char buf[4096];
+		std::string line;
+		while (fgets(buf, sizeof(buf), f))
+		{
+			line += buf;
+			if (line[line.size()-1] != '\n' && !feof(f))
+				continue;
+			if (!tracePath(line))
+			{
+				line.clear();
+				continue;
+			}
+
+			std::map<std::string, u32>::iterator it = byPath.find(line);
+			line.clear();
+			if (it == byPath.end())
+			{
+				unknown ++;
+				continue;
+			}
+
+			// Duplicates are read from wherever their owner is stored
+			u32 i = it->second;
+			if (files[i].dataOwner != ROMFS_NONE)
+				i = files[i].dataOwner;
+			if (placed[i]) continue;
+			placed[i] = true;
+			dataOrder.push_back(i);
+			traced ++;
+		}
+		fclose(f);
+		tracedFiles = traced;
+
+		printf("Ordered the data of %u files by access trace", traced);
+		if (unknown)
+			printf(", %u traced paths are not in the image", unknown);
+		printf("\n");
+	}
+
+	for (u32 i = 0; i < files.size(); i ++)
+		if (!placed[i] && files[i].dataOwner == ROMFS_NONE)
+			dataOrder.push_back(i);
+
+	return 0;
+}
+
+// Alignment of a file's data, from the rule with the largest size
+// threshold the file reaches
+u32 RomFS::DataAlign(u64 size)
+{
+	u32 align = 4;
+	u64 best = 0;
+	for (size_t i = 0; i < opts.align.size(); i ++)
+		if (size >= opts.align[i].minSize && opts.align[i].minSize >= best)
+		{
+			best = opts.align[i].minSize;
+			align = opts.align[i].align;
+		}
+	return align;
+}
+
+// How far ahead in the data order LayoutData looks for small files to put
+// into the padding in front of an aligned one
+#define PACK_WINDOW 256
+
+// Assigns the data offset of every file, in data order. Files are aligned
+// according to the alignment policy; the gap this leaves in front of a file
+// gets filled with upcoming files that only need the default alignment,
+// which keeps small files packed together instead of wasting the space.
+// Files placed by an access trace are never pulled ahead, only those the
+// trace does not mention can fill the gaps.
+void RomFS::LayoutData(void)
+{
+	std::vector<u32> order;
+	order.reserve(dataOrder.size());
+	std::vector<bool> placed(dataOrder.size(), false);
+	u64 padding = 0;
+	u32 alignedFiles = 0, packedFiles = 0;
+
+	fileDataOff = 0;
+	for (size_t k = 0; k < dataOrder.size(); k ++)
+	{
+		if (placed[k]) continue;
+		romfs_file_t& file = files[dataOrder[k]];
+		u32 align = DataAlign(file.dataSize);
+		u64 start = (fileDataOff + align - 1) &~ (u64)(align - 1);
+
+		if (align > 4)
+		{
+			alignedFiles ++;
+			size_t first = k + 1 > tracedFiles ? k + 1 : tracedFiles;
+			size_t end = first + PACK_WINDOW < dataOrder.size() ? first + PACK_WINDOW : dataOrder.size();
+			for (size_t j = first; j < end && fileDataOff < start; j ++)
+			{
+				romfs_file_t& small = files[dataOrder[j]];
+				u64 size = (small.dataSize + 3) &~ 3;
+				if (placed[j] || !small.dataSize || size > start - fileDataOff || DataAlign(small.dataSize) != 4)
+					continue;
+				small.dataOff = fileDataOff;
+				fileDataOff += size;
+				order.push_back(dataOrder[j]);
+				placed[j] = true;
+				packedFiles ++;
+			}
+		}
+
+		padding += start - fileDataOff;
+		file.dataOff = start;
+		fileDataOff = start + file.dataSize;
+		fileDataOff = (fileDataOff + 3) &~ 3;
+		order.push_back(dataOrder[k]);
+	}
+	dataOrder.swap(order);
+
+	for (std::vector<romfs_file_t>::iterator it = files.begin(); it != files.end(); ++it)
+		if (it->dataOwner != ROMFS_NONE)
+			it->dataOff = files[it->dataOwner].dataOff;
+
+	if (opts.align.size())
+		printf("Aligned %u files, packed %u small files into the gaps, %llu bytes of alignment padding (%.2f%% of the data)\n",
+			alignedFiles, packedFiles, (unsigned long long)padding, fileDataOff ? 100.0 * padding / fileDataOff : 0.0);
+}
+
+#define HASH_CHUNK 0x4000
+
+template <typename T>
+struct bucket_task_t
+{
+	const std::vector<romfs_dir_t>* dirs;
+	const std::vector<T>* entries;
+	const u16* names;
+	u32 begin, end, total;
+	u32* buckets;
+};
+
+// Finds the hash bucket of a range of entries
+template <typename T>
+static void bucketTask(void* arg)
+{
+	bucket_task_t<T>* task = (bucket_task_t<T>*)arg;
+	const std::vector<romfs_dir_t>& dirs = *task->dirs;
+	const std::vector<T>& entries = *task->entries;
+	for (u32 i = task->begin; i < task->end; i ++)
+	{
+		const T& e = entries[i];
+		task->buckets[i] = romfs_calc_hash(dirs[e.parent].offset, task->names + e.nameOff, e.nameLen, task->total);
+	}
+}
+
+template <typename T>
+static void calcBuckets(ThreadPool& pool, const std::vector<romfs_dir_t>& dirs, const std::vector<T>& entries,
+	const u16* names, u32 total, std::vector<u32>& buckets)
+{
+	buckets.resize(entries.size());
+	TaskGroup group;
+	std::vector< bucket_task_t<T> > tasks((entries.size() + HASH_CHUNK - 1) / HASH_CHUNK);
+	for (size_t i = 0; i < tasks.size(); i ++)
+	{
+		bucket_task_t<T>& task = tasks[i];
+		task.dirs = &dirs;
+		task.entries = &entries;
+		task.names = names;
+		task.begin = i * HASH_CHUNK;
+		task.end = task.begin + HASH_CHUNK < entries.size() ? task.begin + HASH_CHUNK : entries.size();
+		task.total = total;
+		task.buckets = &buckets.front();
+		pool.Submit(bucketTask<T>, &task, &group);
+	}
+	pool.Wait(&group);
+}
+
+// Links the entries into their buckets. This has to happen in table order
+// to produce the same chains as Nintendo's tools.
+template <typename T>
+static void chainBuckets(std::vector<T>& entries, const std::vector<u32>& buckets, u32* table)
+{
+	for (size_t i = 0; i < entries.size(); i ++)
+	{
+		T& e = entries[i];
+		e.nextHash = table[buckets[i]];
+		table[buckets[i]] = e.offset;
+	}
+}
+
+static void printHashStats(const char* name, const std::vector<u32>& buckets, u32 total)
+{
+	std::vector<u32> chains(total, 0);
+	for (size_t i = 0; i < buckets.size(); i ++)
+		chains[buckets[i]] ++;
+
+	u32 used = 0, maxChain = 0;
+	u64 probes = 0;
+	for (u32 i = 0; i < total; i ++)
+	{
+		u32 len = chains[i];
+		if (!len) continue;
+		used ++;
+		if (len > maxChain) maxChain = len;
+		probes += (u64)len*(len+1)/2; // Entries found after 1, 2, ... len steps
+	}
+
+	printf("%s hash table: %u entries in %u buckets (load %.2f), %u used (%.1f%%)\n",
+		name, (u32)buckets.size(), total, (double)buckets.size() / total, used, 100.0 * used / total);
+	printf("  chain length: max %u, mean %.2f; average entries visited per lookup %.2f\n",
+		maxChain, used ? (double)buckets.size() / used : 0.0, buckets.size() ? (double)probes / buckets.size() : 0.0);
+}
+
+// Bucket count for a table, at least Nintendo's own choice for the entry count
+static u32 hashTableLen(u32 entryCount, double load)
+{
+	u32 count = entryCount;
+	if (load > 0 && load < 1)
+		count = (u32)(entryCount / load + 0.5);
+	return calcHashTableLen(count);
+}
+
+int RomFS::CalcHash(void)
+{
+	dirHashCount = hashTableLen(dirs.size(), opts.hashLoad);
+	fileHashCount = hashTableLen(files.size(), opts.hashLoad);
+	dirHashTable = (u32*)malloc(dirHashCount*4);
+	fileHashTable = (u32*)malloc(fileHashCount*4);
+	if (!dirHashTable || !fileHashTable) die("Out of memory!");
+
+	memset(dirHashTable, 0xFF, dirHashCount*4);
+	memset(fileHashTable, 0xFF, fileHashCount*4);
+
+	// Hashing the names is the expensive part and is independent for every
+	// entry, so the buckets are worked out in parallel first
+	std::vector<u32> dirBuckets, fileBuckets;
+	const u16* pool = names.empty() ? NULL : &names.front();
+	calcBuckets(Pool(), dirs, dirs, pool, dirHashCount, dirBuckets);
+	calcBuckets(Pool(), dirs, files, pool, fileHashCount, fileBuckets);
+
+	chainBuckets(dirs, dirBuckets, dirHashTable);
+	chainBuckets(files, fileBuckets, fileHashTable);
+
+	if (opts.hashStats)
+	{
+		printHashStats("Directory", dirBuckets, dirHashCount);
+		printHashStats("File", fileBuckets, fileHashCount);
+	}
+
+	return 0;
+}
+
+// Entries of every hash bucket in table order. A bucket's chain starts at
+// its last entry, as chainBuckets links them.
+struct hash_chains_t
+{
+	std::vector<u32> start; // Position of each bucket's first entry in members, plus the end
+	std::vector<u32> members;
+	std::vector<u32> pos;   // Position of every entry in members
+
+	hash_chains_t(const std::vector<u32>& buckets, u32 total) :
+		start(total + 1, 0), members(buckets.size()), pos(buckets.size())
+	{
+		for (size_t i = 0; i < buckets.size(); i ++)
+			start[buckets[i] + 1] ++;
+		for (u32 b = 0; b < total; b ++)
+			start[b + 1] += start[b];
+		std::vector<u32> fill(start.begin(), start.end() - 1);
+		for (size_t i = 0; i < buckets.size(); i ++)
+		{
+			pos[i] = fill[buckets[i]]++;
+			members[pos[i]] = i;
+		}
+	}
+};
+
+// Records what finding entry i reads, as RomFSReader would: its bucket,
+// then the chain up to it. Names are only compared once the parent and the
+// length match.
+template <typename T>
+static void traceLookup(const std::vector<T>& entries, const std::vector<u32>& buckets, const hash_chains_t& chains,
+	u32 hashOff, u32 tableOff, u32 entrySize, u32 i, romfs_trace_t& trace)
+{
+	const T& target = entries[i];
+	u32 bucket = buckets[i];
+	trace.reads.push_back(std::make_pair(hashOff + (u64)bucket*4, 4u));
+	for (u32 k = chains.start[bucket + 1]; k-- > chains.pos[i]; )
+	{
+		const T& e = entries[chains.members[k]];
+		trace.probes ++;
+		trace.reads.push_back(std::make_pair(tableOff + (u64)e.offset, entrySize));
+		if (e.parent == target.parent && e.nameLen == target.nameLen && e.nameLen)
+			trace.reads.push_back(std::make_pair(tableOff + (u64)e.offset + entrySize, e.nameLen*2));
+	}
+}
+
+// Average number of cache lines and sectors of metadata touched by looking
+// up every file by its path, given the current entry offsets
+void RomFS::MetaCost(double& lines, double& sectors)
+{
+	std::vector<u32> dirBuckets, fileBuckets;
+	const u16* pool = names.empty() ? NULL : &names.front();
+	calcBuckets(Pool(), dirs, dirs, pool, dirHashCount, dirBuckets);
+	calcBuckets(Pool(), dirs, files, pool, fileHashCount, fileBuckets);
+	hash_chains_t dirChains(dirBuckets, dirHashCount), fileChains(fileBuckets, fileHashCount);
+
+	// Positions within the image, as SerializeMeta lays the tables out
+	u32 dirHashOff = 0x28, dirTableOff = dirHashOff + dirHashCount*4;
+	u32 fileHashOff = dirTableOff + dirOff, fileTableOff = fileHashOff + fileHashCount*4;
+
+	u64 totalLines = 0, totalSectors = 0;
+	std::vector<u64> units;
+	for (u32 i = 0; i < files.size(); i ++)
+	{
+		romfs_trace_t trace;
+		for (u32 d = files[i].parent; d != 0; d = dirs[d].parent)
+			traceLookup(dirs, dirBuckets, dirChains, dirHashOff, dirTableOff, 0x18, d, trace);
+		traceLookup(files, fileBuckets, fileChains, fileHashOff, fileTableOff, 0x20, i, trace);
+
+		units.clear();
+		trace.TouchedUnits(ROMFS_CACHE_LINE_SIZE, units);
+		totalLines += romfsCountDistinct(units);
+		units.clear();
+		trace.TouchedUnits(ROMFS_SECTOR_SIZE, units);
+		totalSectors += romfsCountDistinct(units);
+	}
+	lines = files.empty() ? 0.0 : (double)totalLines / files.size();
+	sectors = files.empty() ? 0.0 : (double)totalSectors / files.size();
+}
+
+static inline u32 remap(const std::vector<u32>& map, u32 i)
+{
+	return i != ROMFS_NONE ? map[i] : ROMFS_NONE;
+}
+
+static inline u32 entryEnd(u32 off, u32 entrySize, u32 nameLen)
+{
+	return (off + entrySize + nameLen*2 + 3) &~ 3;
+}
+
+// Moves the entries to the given positions, old indices in their new
+// order, and assigns their offsets again
+void RomFS::PermuteMeta(const std::vector<u32>& dirOrder, const std::vector<u32>& fileOrder)
+{
+	std::vector<u32> dirMap(dirs.size()), fileMap(files.size());
+	for (u32 i = 0; i < dirOrder.size(); i ++)
+		dirMap[dirOrder[i]] = i;
+	for (u32 i = 0; i < fileOrder.size(); i ++)
+		fileMap[fileOrder[i]] = i;
+
+	std::vector<romfs_dir_t> newDirs;
+	newDirs.reserve(dirs.size());
+	dirOff = 0;
+	for (u32 i = 0; i < dirOrder.size(); i ++)
+	{
+		romfs_dir_t dir = dirs[dirOrder[i]];
+		dir.offset = dirOff;
+		dir.parent = dirMap[dir.parent];
+		dir.sibling = remap(dirMap, dir.sibling);
+		dir.firstSubDir = remap(dirMap, dir.firstSubDir);
+		dir.firstFile = remap(fileMap, dir.firstFile);
+		newDirs.push_back(dir);
+		dirOff = entryEnd(dirOff, 0x18, dir.nameLen);
+	}
+	dirs.swap(newDirs);
+
+	std::vector<romfs_file_t> newFiles;
+	std::vector<romfs_host_t> newHosts;
+	newFiles.reserve(files.size());
+	newHosts.reserve(hosts.size());
+	fileOff = 0;
+	for (u32 i = 0; i < fileOrder.size(); i ++)
+	{
+		romfs_file_t file = files[fileOrder[i]];
+		file.offset = fileOff;
+		file.parent = dirMap[file.parent];
+		file.sibling = remap(fileMap, file.sibling);
+		file.dataOwner = remap(fileMap, file.dataOwner);
+		newFiles.push_back(file);
+		newHosts.push_back(hosts[fileOrder[i]]);
+		fileOff = entryEnd(fileOff, 0x20, file.nameLen);
+	}
+	files.swap(newFiles);
+	hosts.swap(newHosts);
+
+	for (size_t k = 0; k < dataOrder.size(); k ++)
+		dataOrder[k] = fileMap[dataOrder[k]];
+}
+
+// Reorders the entry tables for the lookups on the device. Depth-first
+// order scatters the directories of a path and the entries of a hash chain
+// across the tables; breadth-first keeps the upper levels of the tree and
+// the files of each directory together, while bucket order also places the
+// entries of each chain next to each other. A directory's bucket depends on
+// the offset of its parent, so directories are placed a level at a time
+// and grouped by bucket within their level. Only the metadata moves, the
+// file data stays where LayoutData put it.
+void RomFS::OrderMeta(void)
+{
+	if (opts.metaOrder == ROMFS_META_DFS) return;
+	bool byBucket = opts.metaOrder == ROMFS_META_BUCKET;
+
+	// CalcHash settles on the same sizes later on
+	dirHashCount = hashTableLen(dirs.size(), opts.hashLoad);
+	fileHashCount = hashTableLen(files.size(), opts.hashLoad);
+	double linesBefore, sectorsBefore;
+	MetaCost(linesBefore, sectorsBefore);
+
+	std::vector< std::vector<u32> > subDirs(dirs.size());
+	for (u32 i = 1; i < dirs.size(); i ++)
+		subDirs[dirs[i].parent].push_back(i);
+
+	// Sort keys paired with old indices
+	std::vector< std::pair<u32, u32> > keys;
+	std::vector<u32> dirOrder(1, 0), newOffset(dirs.size(), 0), newIndex(dirs.size(), 0);
+	u32 off = entryEnd(0, 0x18, dirs[0].nameLen);
+	for (size_t levelStart = 0; levelStart < dirOrder.size(); )
+	{
+		size_t levelEnd = dirOrder.size();
+		keys.clear();
+		for (size_t k = levelStart; k < levelEnd; k ++)
+		{
+			const std::vector<u32>& sub = subDirs[dirOrder[k]];
+			for (size_t j = 0; j < sub.size(); j ++)
+			{
+				const romfs_dir_t& dir = dirs[sub[j]];
+				u32 key = byBucket ? romfs_calc_hash(newOffset[dir.parent], Name(dir), dir.nameLen, dirHashCount) : (u32)keys.size();
+				keys.push_back(std::make_pair(key, sub[j]));
+			}
+		}
+		std::sort(keys.begin(), keys.end());
+		for (size_t k = 0; k < keys.size(); k ++)
+		{
+			u32 i = keys[k].second;
+			newIndex[i] = dirOrder.size();
+			newOffset[i] = off;
+			off = entryEnd(off, 0x18, dirs[i].nameLen);
+			dirOrder.push_back(i);
+		}
+		levelStart = levelEnd;
+	}
+
+	// Files follow their directories, or their hash buckets
+	keys.clear();
+	for (u32 i = 0; i < files.size(); i ++)
+	{
+		const romfs_file_t& file = files[i];
+		u32 key = byBucket ? romfs_calc_hash(newOffset[file.parent], Name(file), file.nameLen, fileHashCount) : newIndex[file.parent];
+		keys.push_back(std::make_pair(key, i));
+	}
+	std::sort(keys.begin(), keys.end());
+	std::vector<u32> fileOrder(files.size());
+	for (size_t k = 0; k < keys.size(); k ++)
+		fileOrder[k] = keys[k].second;
+
+	PermuteMeta(dirOrder, fileOrder);
+
+	double lines, sectors;
+	MetaCost(lines, sectors);
+	printf("Ordered the metadata %s: a lookup touches %.2f cache lines and %.2f sectors, depth-first order %.2f and %.2f",
+		byBucket ? "by hash bucket" : "breadth-first", lines, sectors, linesBefore, sectorsBefore);
+	if (linesBefore > 0 && sectorsBefore > 0)
+		printf(" (%+.1f%% and %+.1f%%)", 100.0 * (lines - linesBefore) / linesBefore, 100.0 * (sectors - sectorsBefore) / sectorsBefore);
+	printf("\n");
+}
+
+void RomFS::AddName(romfs_meta_t& m, const oschar_t* ostr)
+{
+	u32 strsize = osstrlen(ostr);
+	m.nameOff = names.size();
+#ifdef WIN32
+	names.insert(names.end(), ostr, ostr+strsize);
+	m.nameLen = strsize;
+#else
+	// We need to convert the UTF-8 input into UTF-16, which never takes
+	// more units than there are bytes
+	names.resize(m.nameOff + strsize);
+	m.nameLen = strsize ? utf8_to_utf16(&names[m.nameOff], ostr, strsize) : 0;
+	names.resize(m.nameOff + m.nameLen);
+#endif
+}
+
+// Builds the UTF-8 path of every entry inside the image, in table order.
+// The root directory is "" and all other paths start with a slash.
+void RomFS::GetPaths(std::vector<std::string>& dirPaths, std::vector<std::string>& filePaths)
+{
+	dirPaths.clear();
+	dirPaths.reserve(dirs.size());
+	for (u32 i = 0; i < dirs.size(); i ++)
+	{
+		romfs_dir_t& dir = dirs[i];
+		std::string path;
+		if (dir.parent != i)
+		{
+			path = dirPaths[dir.parent] + "/";
+			utf16_to_utf8(path, Name(dir), dir.nameLen);
+		}
+		dirPaths.push_back(path);
+	}
+
+	filePaths.clear();
+	filePaths.reserve(files.size());
+	for (std::vector<romfs_file_t>::iterator it = files.begin(); it != files.end(); ++it)
+	{
+		romfs_file_t& file = *it;
+		std::string path = dirPaths[file.parent] + "/";
+		utf16_to_utf8(path, Name(file), file.nameLen);
+		filePaths.push_back(path);
+	}
+}
+
+u32 RomFS::AddDir(u32 parent, const oschar_t* name)
+{
+	u32 index = dirs.size();
+	dirs.push_back(romfs_dir_t());
+	romfs_dir_t& dir = dirs.back();
+	dir.offset = dirOff;
+	dir.parent = parent != ROMFS_NONE ? parent : index;
+	if (name)
+		AddName(dir, name);
+	dirOff += 0x18 + dir.nameLen*2;
+	dirOff = (dirOff + 3) &~ 3;
+	return index;
+}
+
+u32 RomFS::AddFile(u32 parent, const oschar_t* name)
+{
+	u32 index = files.size();
+	files.push_back(romfs_file_t(parent));
+	hosts.push_back(romfs_host_t());
+	romfs_file_t& file = files.back();
+	file.offset = fileOff;
+	AddName(file, name);
+	fileOff += 0x20 + file.nameLen*2;
+	fileOff = (fileOff + 3) &~ 3;
+	return index;
+}
+
+// Stores dir/name in the host path pool and returns its position there
+size_t RomFS::AddHostPath(const osstring& dir, const oschar_t* name)
+{
+	size_t pos = hostPaths.size();
+	hostPaths.insert(hostPaths.end(), dir.begin(), dir.end());
+	if (name)
+	{
+		hostPaths.push_back(OSWILDCARD[0]);
+		for (; *name; name ++)
+			hostPaths.push_back(*name);
+	}
+	hostPaths.push_back(0);
+	return pos;
 }
@@ -1,4 +1,12 @@
 #pragma once
+#include <stdlib.h>
+#include <pthread.h>
+#include <vector>
+#include <string>
+#include <map>
+#include "types.h"
+#include "FileClass.h"
+
 #ifdef WIN32
 #include <windows.h>
 typedef WCHAR oschar_t;
@@ -16,62 +24,240 @@ typedef char oschar_t;
 #define OSWILDCARD "/"
 #endif
 
-typedef std::vector<u16> romfs_str;
+typedef std::basic_string<oschar_t> osstring;
+
+static inline FILE* osfopen(const oschar_t* path, const char* mode)
+{
+#ifdef WIN32
+	WCHAR wmode[4] = { 0 };
+	for (int i = 0; i < 3 && mode[i]; i ++) wmode[i] = mode[i];
+	return _wfopen(path, wmode);
+#else
+	return fopen(path, mode);
+#endif
+}
+
+// Parses a size given on the command line, K/M/G suffixes allowed
+static inline bool parseSize(const char* str, u64& out)
+{
+	char* end;
+	out = strtoull(str, &end, 0);
+	switch (*end)
+	{
+		case 'K': case 'k': out <<= 10; end++; break;
+		case 'M': case 'm': out <<= 20; end++; break;
+		case 'G': case 'g': out <<= 30; end++; break;
+	}
+	return end != str && !*end;
+}
+
+// Hash function of the directory and file hash tables, keyed on the offset
+// of the parent directory and the UTF-16 name of the entry
+static inline u32 romfs_calc_hash(u32 parent, const u16* str, u32 len, u32 total)
+{
+	u32 hash = parent ^ 123456789;
+	for (u32 i = 0; i < len; i ++)
+	{
+		hash = (hash >> 5) | (hash << 27);
+		hash ^= str[i];
+	}
+	return hash % total;
+}
+
+// Entries live in contiguous arrays and refer to each other by index,
+// their names are stored back to back in a single UTF-16 pool
+#define ROMFS_NONE 0xFFFFFFFF
 
 struct romfs_meta_t
 {
-	romfs_str name;
+	u32 nameOff, nameLen; // Position within the name pool, in UTF-16 units
 	u32 offset;
 	u32 nextHash;
 
-	romfs_meta_t() : name(), offset(0), nextHash(~0) { }
+	romfs_meta_t() : nameOff(0), nameLen(0), offset(0), nextHash(~0) { }
 };
 
-struct romfs_file_t; // Forward declaration
-
 struct romfs_dir_t : public romfs_meta_t
 {
-	romfs_dir_t *parent;
-	romfs_dir_t *sibling;
-	romfs_dir_t *firstSubDir;
-	romfs_file_t *firstFile;
+	u32 parent;
+	u32 sibling;
+	u32 firstSubDir;
+	u32 firstFile;
 
-	romfs_dir_t() : romfs_meta_t(), parent(NULL), sibling(NULL), firstSubDir(NULL), firstFile(NULL) { }
+	romfs_dir_t() : romfs_meta_t(), parent(ROMFS_NONE), sibling(ROMFS_NONE), firstSubDir(ROMFS_NONE), firstFile(ROMFS_NONE) { }
 };
 
 struct romfs_file_t : public romfs_meta_t
 {
-	romfs_dir_t *parent;
-	romfs_file_t *sibling;
+	u32 parent;
+	u32 sibling;
 	u64 dataOff, dataSize;
-	void* data;
+	u32 dataOwner; // File whose identical data this one shares
+
+	romfs_file_t(u32 parent) : romfs_meta_t(), parent(parent), sibling(ROMFS_NONE), dataOff(0), dataSize(0), dataOwner(ROMFS_NONE) { }
+};
 
-	romfs_file_t(romfs_dir_t* parent) : romfs_meta_t(), parent(parent), sibling(NULL), dataOff(0), dataSize(0), data(NULL) { }
-	~romfs_file_t() { if (data) free(data); }
+// Where the contents of a file come from. Kept apart from romfs_file_t as
+// only the data writers need it, not the metadata passes.
+struct romfs_host_t
+{
+	size_t pathOff;           // Position of the NUL terminated path within the path pool
+	u64 hostOff;              // Offset of the contents within that file
+	u64 mtime, inode, device; // Identity of the source file
+
+	romfs_host_t() : pathOff(0), hostOff(0), mtime(0), inode(0), device(0) { }
+};
+
+struct romfs_scan_dir_t; // Forward declaration
+class IvfcWriter;
+class ThreadPool;
+class IoLimit;
+class ScanCache;
+
+// Host directory listing gathered by the scanner, kept in the order the OS
+// returned it so that the image layout does not depend on thread timing
+struct romfs_scan_ent_t
+{
+	osstring name;
+	osstring hostPath; // Only set when the file does not live at path/name
+	u64 hostOff; // Offset of the contents within the host file
+	u64 size, mtime, inode, device;
+	romfs_scan_dir_t* dir; // NULL for files
+
+	romfs_scan_ent_t() : name(), hostPath(), hostOff(0), size(0), mtime(0), inode(0), device(0), dir(NULL) { }
+};
+
+struct romfs_scan_dir_t
+{
+	osstring path;
+	std::vector<romfs_scan_ent_t> entries;
+
+	romfs_scan_dir_t(const osstring& path) : path(path), entries() { }
+	~romfs_scan_dir_t();
+};
+
+// Files of at least minSize bytes get their data aligned to align bytes
+struct romfs_align_t
+{
+	u64 minSize;
+	u32 align;
+};
+
+// Order of the entries within the directory and file tables
+enum romfs_meta_order_t
+{
+	ROMFS_META_DFS,    // Depth-first, in the order the tree is walked
+	ROMFS_META_BFS,    // Breadth-first, the files of a directory next to each other
+	ROMFS_META_BUCKET  // Entries sharing a hash chain next to each other
+};
+
+struct romfs_opts_t
+{
+	int threads; // Worker threads for scanning, 0 = one per CPU
+	int readers; // Threads prefetching file data while the image is written
+	u64 readAhead; // Maximum number of file data bytes buffered at once
+	bool zeroCopy; // Let the kernel copy file data when the output allows it
+	bool dedupe; // Store the data of files with identical contents only once
+	double hashLoad; // Target entries per hash bucket, 1 = Nintendo's table sizes
+	bool hashStats; // Print the occupancy of the hash tables
+	const char* traceFile; // Paths in first-access order, their data is laid out in that order
+	std::vector<romfs_align_t> align; // Data alignment policy, files not covered use 4 bytes
+	bool sort; // Order entries by name instead of the order the OS lists them in
+	romfs_meta_order_t metaOrder; // Layout of the entry tables
+	const char* fileList; // Manifest of image paths and their host files, replaces the directory scan
+	bool ivfc; // Wrap the image in an IVFC hash tree, as stored in NCCH containers
+	u64 maxMemory; // Cap on the file contents buffered at once across all threads, 0 = none
+	ThreadPool* pool; // Shared with other builds, NULL = create one with the given number of threads
+	IoLimit* ioLimit; // Bounds the threads reading or writing files at once, NULL = no bound
+	ScanCache* scanCache; // Trees scanned by other builds, NULL = always scan
+	std::vector<std::string> lz11; // Extensions of the files stored LZ11 compressed, with their dot
+	bool sparse; // Leave holes in the output where the image has whole blocks of zeros
+	const char* base; // Existing image the input is laid over, NULL = the input is all there is
+
+	romfs_opts_t() : threads(0), readers(4), readAhead(64<<20), zeroCopy(true), dedupe(false),
+		hashLoad(1.0), hashStats(false), traceFile(NULL), align(), sort(false), metaOrder(ROMFS_META_DFS), fileList(NULL), ivfc(false),
+		maxMemory(0), pool(NULL), ioLimit(NULL), scanCache(NULL), lz11(), sparse(false), base(NULL) { }
+};
+
+// Directory trees shared between builds running at the same time, so that
+// an input directory several images are built from is only scanned once.
+// Builds only read the trees, which live as long as the cache.
+class ScanCache
+{
+	std::map<osstring, romfs_scan_dir_t*> trees; // NULL while being scanned
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+public:
+	ScanCache();
+	~ScanCache();
+
+	// Returns true and the tree if path has been scanned before. Otherwise
+	// the caller is expected to scan it and Put() the result; builds asking
+	// for the same directory in the meantime wait for it.
+	bool Get(const osstring& path, romfs_scan_dir_t*& tree);
+	// Takes over the tree, NULL if the scan failed
+	void Put(const osstring& path, romfs_scan_dir_t* tree);
 };
 
 class RomFS
 {
+	romfs_opts_t opts;
+
 	u32 *dirHashTable, *fileHashTable;
 	u32 dirHashCount, fileHashCount;
 
 	u32 dirOff, fileOff;
 	u64 fileDataOff;
 
-	std::list<romfs_dir_t> dirs;
-	std::list<romfs_file_t> files;
+	std::vector<romfs_dir_t> dirs;
+	std::vector<romfs_file_t> files;
+	std::vector<romfs_host_t> hosts; // One per file
+	std::vector<u16> names;          // Name pool
+	std::vector<oschar_t> hostPaths; // Host path pool
+	std::vector<u32> dataOrder;      // Files that own their data, in the order it is stored
+	u32 tracedFiles;                 // Leading entries of dataOrder placed by the access trace
+	ThreadPool* ownPool;             // Created on first use unless the options bring one
+	std::vector<osstring> spoolPaths; // Temporary files holding compressed file data
 
-	romfs_dir_t& AddDir(romfs_dir_t* parent, const oschar_t* name);
-	romfs_file_t& AddFile(romfs_dir_t* parent, const oschar_t* name);
+	u32 AddDir(u32 parent, const oschar_t* name);
+	u32 AddFile(u32 parent, const oschar_t* name);
+	void AddName(romfs_meta_t& m, const oschar_t* name);
+	size_t AddHostPath(const osstring& dir, const oschar_t* name);
 
-	romfs_dir_t& Root() { return dirs.front(); }
+	const u16* Name(const romfs_meta_t& m) const { return m.nameLen ? &names[m.nameOff] : NULL; }
+	const oschar_t* HostPath(u32 file) const { return &hostPaths[hosts[file].pathOff]; }
 
-	int ScanDir(romfs_dir_t& dir, const oschar_t* path);
+	ThreadPool& Pool();
+	int ScanTree(romfs_scan_dir_t& root);
+	int ScanCached(romfs_scan_dir_t*& tree);
+	int LoadFileList(romfs_scan_dir_t& root);
+	int LoadBase(romfs_scan_dir_t& root, romfs_scan_dir_t& overlay);
+	void ReserveTree(romfs_scan_dir_t& root);
+	void AddTree(u32 dir, romfs_scan_dir_t& node);
+	int CompressFiles(void);
+	int HashFiles(const std::vector<u32>& list, u8* hashes);
+	int Dedupe(void);
+	int OrderData(void);
+	u32 DataAlign(u64 size);
+	void LayoutData(void);
+	void OrderMeta(void);
+	void PermuteMeta(const std::vector<u32>& dirOrder, const std::vector<u32>& fileOrder);
+	void MetaCost(double& lines, double& sectors);
 	int CalcHash(void);
+	int ZeroCopyData(FileClass& f, u32& first, bool sparse);
+	int WriteImage(FileClass& f, IvfcWriter* ivfc, u64 budget);
+	size_t CopyBufSize(int users);
+
+	u32 DataStart();
+	u64 SlotEnd(u32 k);
+	void SerializeMeta(u8* buf);
+	void GetPaths(std::vector<std::string>& dirPaths, std::vector<std::string>& filePaths);
 
 public:
-	RomFS();
+	RomFS(const romfs_opts_t& opts = romfs_opts_t());
 	~RomFS();
 	int Build(const char* path);
 	int WriteToFile(FileClass& f);
+	int WriteIncremental(const char* outPath);
 };
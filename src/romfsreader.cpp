@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include "romfsreader.h"
+#include "utf.h"
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#define die(msg) do { fputs(msg "\n\n", stderr); return 1; } while(0)
+
+RomFSReader::RomFSReader() :
+	image(NULL), imageSize(0), mapping(NULL), mapSize(0),
+#ifdef WIN32
+	hMap(NULL),
+#endif
+	dirHashOff(0), dirHashCount(0), dirTableOff(0), dirTableSize(0),
+	fileHashOff(0), fileHashCount(0), fileTableOff(0), fileTableSize(0),
+	dataOff(0)
+{
+}
+
+RomFSReader::~RomFSReader()
+{
+	Close();
+}
+
+void RomFSReader::Close()
+{
+	if (mapping)
+	{
+#ifdef WIN32
+		UnmapViewOfFile(mapping);
+		CloseHandle(hMap);
+		hMap = NULL;
+#else
+		munmap(mapping, mapSize);
+#endif
+		mapping = NULL;
+	}
+	image = NULL;
+	imageSize = 0;
+}
+
+int RomFSReader::Open(const oschar_t* path, u64 offset)
+{
+	Close();
+
+#ifdef WIN32
+	HANDLE hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) die("Cannot open RomFS image");
+	LARGE_INTEGER size;
+	if (GetFileSizeEx(hFile, &size) && size.QuadPart)
+	{
+		mapSize = size.QuadPart;
+		hMap = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (hMap)
+		{
+			mapping = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+			if (!mapping)
+			{
+				CloseHandle(hMap);
+				hMap = NULL;
+			}
+		}
+	}
+	CloseHandle(hFile);
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) die("Cannot open RomFS image");
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) == 0 && statbuf.st_size > 0)
+	{
+		mapSize = statbuf.st_size;
+		mapping = mmap(NULL, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+		if (mapping == MAP_FAILED)
+			mapping = NULL;
+	}
+	close(fd);
+#endif
+
+	if (!mapping) die("Cannot map RomFS image");
+	if (offset > mapSize) die("Not a RomFS image");
+	image = (const u8*)mapping + offset;
+	imageSize = mapSize - offset;
+	return Parse();
+}
+
+int RomFSReader::OpenMemory(const void* data, u64 size)
+{
+	Close();
+	image = (const u8*)data;
+	imageSize = size;
+	return Parse();
+}
+
+u32 RomFSReader::Word(u64 pos) const
+{
+	u32 value;
+	memcpy(&value, image + pos, 4);
+	return le_word(value);
+}
+
+static inline u64 dword(const u8* p)
+{
+	u64 value;
+	memcpy(&value, p, 8);
+	return le_dword(value);
+}
+
+int RomFSReader::Parse(void)
+{
+	// Images wrapped in an IVFC hash tree start at level 3
+	ivfc = false;
+	if (imageSize >= 0x60 && memcmp(image, "IVFC", 4) == 0)
+	{
+		u32 blockLog2 = Word(0x4C);
+		if (blockLog2 > 30) die("Corrupted IVFC header");
+		u64 level3Off = ((u64)Word(8) + 0x60 + (1u << blockLog2) - 1) &~ ((1ULL << blockLog2) - 1);
+		u64 level3Size = dword(image + 0x44);
+		if (level3Off > imageSize || level3Size > imageSize - level3Off) die("Corrupted IVFC header");
+		image += level3Off;
+		imageSize = level3Size;
+		ivfc = true;
+	}
+
+	if (imageSize < 0x28 || Word(0) != 0x28) die("Not a RomFS image");
+
+	// Every table has to lie within the image
+	u32 hdr[9];
+	for (int i = 0; i < 9; i ++)
+		hdr[i] = Word(4 + i*4);
+	for (int i = 0; i < 8; i += 2)
+		if ((u64)hdr[i] + hdr[i+1] > imageSize) die("Corrupted RomFS image");
+	if (hdr[8] > imageSize || (hdr[1] & 3) || (hdr[5] & 3)) die("Corrupted RomFS image");
+
+	dirHashOff = hdr[0];
+	dirHashCount = hdr[1] / 4;
+	dirTableOff = hdr[2];
+	dirTableSize = hdr[3];
+	fileHashOff = hdr[4];
+	fileHashCount = hdr[5] / 4;
+	fileTableOff = hdr[6];
+	fileTableSize = hdr[7];
+	dataOff = hdr[8];
+
+	if (!dirHashCount || !fileHashCount || dirTableSize < 0x18) die("Corrupted RomFS image");
+	return 0;
+}
+
+int RomFSReader::GetDir(u32 off, romfs_dir_info_t& dir) const
+{
+	if (off > dirTableSize || dirTableSize - off < 0x18) die("Corrupted RomFS directory entry");
+	u64 pos = dirTableOff + (u64)off;
+	dir.parent = Word(pos);
+	dir.sibling = Word(pos + 4);
+	dir.firstSubDir = Word(pos + 8);
+	dir.firstFile = Word(pos + 12);
+	dir.nextHash = Word(pos + 16);
+	u32 nameSize = Word(pos + 20);
+	if ((nameSize & 1) || nameSize > dirTableSize - off - 0x18) die("Corrupted RomFS directory entry");
+	dir.name = image + pos + 0x18;
+	dir.nameLen = nameSize / 2;
+	return 0;
+}
+
+int RomFSReader::GetFile(u32 off, romfs_file_info_t& file) const
+{
+	if (off > fileTableSize || fileTableSize - off < 0x20) die("Corrupted RomFS file entry");
+	u64 pos = fileTableOff + (u64)off;
+	file.parent = Word(pos);
+	file.sibling = Word(pos + 4);
+	file.dataOff = dword(image + pos + 8);
+	file.dataSize = dword(image + pos + 16);
+	file.nextHash = Word(pos + 24);
+	u32 nameSize = Word(pos + 28);
+	if ((nameSize & 1) || nameSize > fileTableSize - off - 0x20) die("Corrupted RomFS file entry");
+	file.name = image + pos + 0x20;
+	file.nameLen = nameSize / 2;
+
+	u64 dataSize = imageSize - dataOff;
+	if (file.dataOff > dataSize || file.dataSize > dataSize - file.dataOff) die("Corrupted RomFS file entry");
+	return 0;
+}
+
+static bool sameName(const u8* stored, u32 storedLen, const u16* name, u32 len)
+{
+	if (storedLen != len) return false;
+	for (u32 i = 0; i < len; i ++)
+		if ((u16)(stored[i*2] | stored[i*2+1] << 8) != name[i])
+			return false;
+	return true;
+}
+
+// Walks the chain of the bucket the name hashes to, checking the parent
+// and the name of every entry on it just like the console's lookup does
+u32 RomFSReader::FindEntry(bool isDir, u32 parent, const u16* name, u32 len, romfs_trace_t* trace) const
+{
+	u32 bucket = romfs_calc_hash(parent, name, len, isDir ? dirHashCount : fileHashCount);
+	u32 off = isDir ? DirBucket(bucket) : FileBucket(bucket);
+	if (trace)
+		trace->reads.push_back(std::make_pair((isDir ? dirHashOff : fileHashOff) + (u64)bucket*4, 4u));
+
+	// A chain cannot be longer than the table has entries, anything beyond
+	// that means the image contains a loop
+	u32 limit = isDir ? MaxDirs() : MaxFiles();
+	for (; off != ROMFS_NONE && limit; limit --)
+	{
+		u32 entryParent, next;
+		const u8* entryName;
+		u32 entryLen;
+		if (isDir)
+		{
+			romfs_dir_info_t dir;
+			if (GetDir(off, dir) != 0) break;
+			entryParent = dir.parent;
+			next = dir.nextHash;
+			entryName = dir.name;
+			entryLen = dir.nameLen;
+		} else
+		{
+			romfs_file_info_t file;
+			if (GetFile(off, file) != 0) break;
+			entryParent = file.parent;
+			next = file.nextHash;
+			entryName = file.name;
+			entryLen = file.nameLen;
+		}
+
+		// The name is only looked at once the parent and the length match
+		bool match = entryParent == parent && entryLen == len;
+		if (trace)
+		{
+			trace->probes ++;
+			u64 pos = (isDir ? dirTableOff : fileTableOff) + (u64)off;
+			trace->reads.push_back(std::make_pair(pos, isDir ? 0x18u : 0x20u));
+			if (match && len)
+				trace->reads.push_back(std::make_pair((u64)(entryName - image), len*2));
+		}
+		if (match && sameName(entryName, entryLen, name, len))
+			return off;
+		off = next;
+	}
+	return ROMFS_NONE;
+}
+
+int RomFSReader::Resolve(const char* path, bool fileOnly, u32& off, bool& isDir, romfs_trace_t* trace) const
+{
+	std::vector<u16> name;
+	off = 0;
+	isDir = true;
+
+	while (*path)
+	{
+		while (*path == '/') path ++;
+		if (!*path) break;
+		if (!isDir) return 1; // A file has no children
+
+		size_t len = strcspn(path, "/");
+		name.resize(len);
+		u32 units = utf8_to_utf16(&name.front(), path, len);
+		path += len;
+		while (*path == '/') path ++;
+
+		u32 child = ROMFS_NONE;
+		if (!fileOnly || *path)
+			child = FindDir(off, &name.front(), units, trace);
+		if (child == ROMFS_NONE && (!fileOnly || !*path))
+		{
+			child = FindFile(off, &name.front(), units, trace);
+			if (child == ROMFS_NONE) return 1;
+			isDir = false;
+		}
+		if (child == ROMFS_NONE) return 1;
+		off = child;
+	}
+	return fileOnly && isDir ? 1 : 0;
+}
+
+void romfs_trace_t::TouchedUnits(u32 unitSize, std::vector<u64>& units) const
+{
+	for (size_t i = 0; i < reads.size(); i ++)
+	{
+		u64 first = reads[i].first / unitSize;
+		u64 last = (reads[i].first + reads[i].second - 1) / unitSize;
+		for (u64 unit = first; unit <= last; unit ++)
+			units.push_back(unit);
+	}
+}
+
+size_t romfsCountDistinct(std::vector<u64>& units)
+{
+	std::sort(units.begin(), units.end());
+	return std::unique(units.begin(), units.end()) - units.begin();
+}
+
+void romfsNameToUtf8(std::string& out, const u8* name, u32 len)
+{
+	std::vector<u16> units(len);
+	for (u32 i = 0; i < len; i ++)
+		units[i] = name[i*2] | name[i*2+1] << 8;
+	if (len) utf16_to_utf8(out, &units.front(), len);
+}
@@ -0,0 +1,117 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "types.h"
+#include "romfs.h"
+
+// Parsed directory entry of an image. The name points into the image and
+// is stored as little endian UTF-16.
+struct romfs_dir_info_t
+{
+	u32 parent, sibling, firstSubDir, firstFile, nextHash;
+	const u8* name;
+	u32 nameLen; // In UTF-16 units
+};
+
+struct romfs_file_info_t
+{
+	u32 parent, sibling, nextHash;
+	u64 dataOff, dataSize;
+	const u8* name;
+	u32 nameLen;
+};
+
+// Units lookups are costed in
+#define ROMFS_CACHE_LINE_SIZE 64
+#define ROMFS_SECTOR_SIZE 0x200
+
+// Records what a lookup reads from the metadata region
+struct romfs_trace_t
+{
+	u32 probes; // Hash chain entries visited
+	std::vector< std::pair<u64, u32> > reads; // Image offset and size of every access
+
+	romfs_trace_t() : probes(0), reads() { }
+
+	// Adds the units of the given size that the recorded reads touch
+	void TouchedUnits(u32 unitSize, std::vector<u64>& units) const;
+};
+
+// Sorts the units and returns how many different ones there are
+size_t romfsCountDistinct(std::vector<u64>& units);
+
+// Read-only view of a RomFS image, either memory mapped from a host file or
+// supplied by the caller. Entries are addressed by their offset within the
+// directory or file table, as in the image itself, and every offset is
+// bounds checked before it is used. File data is handed out as pointers into
+// the image, nothing gets copied.
+class RomFSReader
+{
+	const u8* image;
+	u64 imageSize;
+
+	void* mapping;
+	u64 mapSize;
+#ifdef WIN32
+	HANDLE hMap;
+#endif
+
+	u32 dirHashOff, dirHashCount, dirTableOff, dirTableSize;
+	u32 fileHashOff, fileHashCount, fileTableOff, fileTableSize;
+	u64 dataOff;
+	bool ivfc;
+
+	u32 Word(u64 pos) const;
+	int Parse(void);
+	u32 FindEntry(bool isDir, u32 parent, const u16* name, u32 len, romfs_trace_t* trace) const;
+	int Resolve(const char* path, bool fileOnly, u32& off, bool& isDir, romfs_trace_t* trace) const;
+
+public:
+	RomFSReader();
+	~RomFSReader();
+
+	// Maps the image starting at offset within a host file
+	int Open(const oschar_t* path, u64 offset = 0);
+	// Uses an image that is already in memory, which must outlive the reader
+	int OpenMemory(const void* data, u64 size);
+	void Close();
+
+	int GetDir(u32 off, romfs_dir_info_t& dir) const;
+	int GetFile(u32 off, romfs_file_info_t& file) const;
+	const u8* FileData(const romfs_file_info_t& file) const { return image + dataOff + file.dataOff; }
+
+	// The whole image and where its file data region starts
+	const u8* Image() const { return image; }
+	u64 ImageSize() const { return imageSize; }
+	u64 DataOffset() const { return dataOff; }
+	// Whether the image was found inside an IVFC hash tree
+	bool IsIvfc() const { return ivfc; }
+	// Position of the image within the host file it was opened from
+	u64 FileOffset() const { return mapping ? image - (const u8*)mapping : 0; }
+
+	// Resolves a child through the hash tables the way the console does,
+	// returns ROMFS_NONE if there is no such entry
+	u32 FindDir(u32 parent, const u16* name, u32 len, romfs_trace_t* trace = NULL) const { return FindEntry(true, parent, name, len, trace); }
+	u32 FindFile(u32 parent, const u16* name, u32 len, romfs_trace_t* trace = NULL) const { return FindEntry(false, parent, name, len, trace); }
+
+	// Resolves a UTF-8 path such as "/dir/file.bin" component by component.
+	// Returns 0 and the offset of the entry if found, 1 otherwise.
+	int Lookup(const char* path, u32& off, bool& isDir, romfs_trace_t* trace = NULL) const
+		{ return Resolve(path, false, off, isDir, trace); }
+	// Same, but like opening a file on the console the last component is
+	// only searched for in the file table
+	int LookupFile(const char* path, u32& off, romfs_trace_t* trace = NULL) const
+		{ bool isDir; return Resolve(path, true, off, isDir, trace); }
+
+	// Upper bounds on the number of entries, for catching loops in corrupted images
+	u32 MaxDirs() const { return dirTableSize / 0x18; }
+	u32 MaxFiles() const { return fileTableSize / 0x20; }
+
+	u32 NumDirBuckets() const { return dirHashCount; }
+	u32 NumFileBuckets() const { return fileHashCount; }
+	u32 DirBucket(u32 i) const { return Word(dirHashOff + (u64)i*4); }
+	u32 FileBucket(u32 i) const { return Word(fileHashOff + (u64)i*4); }
+};
+
+// Converts a name as stored in the image
+void romfsNameToUtf8(std::string& out, const u8* name, u32 len);
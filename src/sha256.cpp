@@ -0,0 +1,232 @@
+#include <string.h>
+#include "sha256.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_X86
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+#include <arm_neon.h>
+#define SHA256_ARM
+#endif
+
+static const u32 K[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_c(u32* state, const u8* data, size_t count)
+{
+	for (; count; count --, data += 64)
+	{
+		u32 w[64];
+		for (int i = 0; i < 16; i ++)
+			w[i] = (u32)data[i*4] << 24 | (u32)data[i*4+1] << 16 | (u32)data[i*4+2] << 8 | data[i*4+3];
+		for (int i = 16; i < 64; i ++)
+		{
+			u32 s0 = ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3);
+			u32 s1 = ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10);
+			w[i] = w[i-16] + s0 + w[i-7] + s1;
+		}
+
+		u32 a = state[0], b = state[1], c = state[2], d = state[3];
+		u32 e = state[4], f = state[5], g = state[6], h = state[7];
+		for (int i = 0; i < 64; i ++)
+		{
+			u32 t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+			u32 t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+	}
+}
+
+#ifdef SHA256_X86
+// Uses the SHA extensions, which keep the state as ABEF/CDGH halves and
+// run two rounds per instruction
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_shani(u32* state, const u8* data, size_t count)
+{
+	const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1); // CDAB
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B); // EFGH
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0); // CDGH
+
+	for (; count; count --, data += 64)
+	{
+		__m128i abef = state0, cdgh = state1;
+		__m128i w[4];
+		for (int i = 0; i < 16; i ++)
+		{
+			if (i < 4)
+				w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + i*16)), swap);
+			else
+			{
+				__m128i t = _mm_sha256msg1_epu32(w[i&3], w[(i+1)&3]);
+				t = _mm_add_epi32(t, _mm_alignr_epi8(w[(i+3)&3], w[(i+2)&3], 4));
+				w[i&3] = _mm_sha256msg2_epu32(t, w[(i+3)&3]);
+			}
+			__m128i msg = _mm_add_epi32(w[i&3], _mm_loadu_si128((const __m128i*)&K[i*4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+		}
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B); // FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1); // DCHG
+	_mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, state1, 0xF0)); // DCBA
+	_mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(state1, tmp, 8)); // HGFE
+}
+
+static bool haveShaNi(void)
+{
+	unsigned a, b, c, d;
+	if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & (1 << 19)) || !(c & (1 << 9)))
+		return false; // SSE4.1 and SSSE3
+	if (__get_cpuid_max(0, NULL) < 7)
+		return false;
+	__cpuid_count(7, 0, a, b, c, d);
+	return (b & (1 << 29)) != 0;
+}
+#endif
+
+#ifdef SHA256_ARM
+// ARMv8 crypto extensions, only built when the target has them anyway
+static void sha256_blocks_arm(u32* state, const u8* data, size_t count)
+{
+	uint32x4_t state0 = vld1q_u32(&state[0]), state1 = vld1q_u32(&state[4]);
+
+	for (; count; count --, data += 64)
+	{
+		uint32x4_t abcd = state0, efgh = state1;
+		uint32x4_t w[4];
+		for (int i = 0; i < 16; i ++)
+		{
+			if (i < 4)
+				w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i*16)));
+			else
+				w[i&3] = vsha256su1q_u32(vsha256su0q_u32(w[i&3], w[(i+1)&3]), w[(i+2)&3], w[(i+3)&3]);
+			uint32x4_t msg = vaddq_u32(w[i&3], vld1q_u32(&K[i*4]));
+			uint32x4_t prev = state0;
+			state0 = vsha256hq_u32(state0, state1, msg);
+			state1 = vsha256h2q_u32(state1, prev, msg);
+		}
+		state0 = vaddq_u32(state0, abcd);
+		state1 = vaddq_u32(state1, efgh);
+	}
+
+	vst1q_u32(&state[0], state0);
+	vst1q_u32(&state[4], state1);
+}
+#endif
+
+typedef void (*sha256_blocks_func)(u32* state, const u8* data, size_t count);
+
+static sha256_blocks_func pickBlocks(void)
+{
+#if defined(SHA256_X86)
+	if (haveShaNi())
+		return sha256_blocks_shani;
+#elif defined(SHA256_ARM)
+	return sha256_blocks_arm;
+#endif
+	return sha256_blocks_c;
+}
+
+// Picks the fastest implementation the CPU supports on first use. Threads
+// racing here all store the same pointer.
+static void sha256_blocks(u32* state, const u8* data, size_t count)
+{
+	static sha256_blocks_func impl = NULL;
+	sha256_blocks_func func = __atomic_load_n(&impl, __ATOMIC_RELAXED);
+	if (!func)
+	{
+		func = pickBlocks();
+		__atomic_store_n(&impl, func, __ATOMIC_RELAXED);
+	}
+	func(state, data, count);
+}
+
+void sha256_init(sha256_ctx* ctx)
+{
+	static const u32 init[8] =
+	{
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	memcpy(ctx->state, init, sizeof(init));
+	ctx->length = 0;
+}
+
+void sha256_update(sha256_ctx* ctx, const void* data, size_t size)
+{
+	const u8* in = (const u8*)data;
+	size_t used = ctx->length & 63;
+	ctx->length += size;
+
+	if (used)
+	{
+		size_t fill = 64 - used;
+		if (size < fill)
+		{
+			memcpy(ctx->buffer + used, in, size);
+			return;
+		}
+		memcpy(ctx->buffer + used, in, fill);
+		sha256_blocks(ctx->state, ctx->buffer, 1);
+		in += fill;
+		size -= fill;
+	}
+
+	sha256_blocks(ctx->state, in, size / 64);
+	in += size &~ 63;
+	memcpy(ctx->buffer, in, size & 63);
+}
+
+void sha256_final(sha256_ctx* ctx, u8* hash)
+{
+	u64 bits = ctx->length * 8;
+	size_t used = ctx->length & 63;
+
+	ctx->buffer[used++] = 0x80;
+	if (used > 56)
+	{
+		memset(ctx->buffer + used, 0, 64 - used);
+		sha256_blocks(ctx->state, ctx->buffer, 1);
+		used = 0;
+	}
+	memset(ctx->buffer + used, 0, 56 - used);
+	for (int i = 0; i < 8; i ++)
+		ctx->buffer[56 + i] = (u8)(bits >> (56 - i*8));
+	sha256_blocks(ctx->state, ctx->buffer, 1);
+
+	for (int i = 0; i < 8; i ++)
+	{
+		hash[i*4]   = (u8)(ctx->state[i] >> 24);
+		hash[i*4+1] = (u8)(ctx->state[i] >> 16);
+		hash[i*4+2] = (u8)(ctx->state[i] >> 8);
+		hash[i*4+3] = (u8)(ctx->state[i]);
+	}
+}
+
+void sha256(const void* data, size_t size, u8* hash)
+{
+	sha256_ctx ctx;
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, size);
+	sha256_final(&ctx, hash);
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <stddef.h>
+#include "types.h"
+
+#define SHA256_HASH_SIZE 32
+
+typedef struct
+{
+	u32 state[8];
+	u64 length;
+	u8 buffer[64];
+} sha256_ctx;
+
+void sha256_init(sha256_ctx* ctx);
+void sha256_update(sha256_ctx* ctx, const void* data, size_t size);
+void sha256_final(sha256_ctx* ctx, u8* hash);
+
+// One-shot helper
+void sha256(const void* data, size_t size, u8* hash);
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "types.h"
+#include "utf.h"
 #include "lodepng/lodepng.h"
 #ifdef WIN32
 #include <wchar.h>
@@ -138,128 +139,29 @@ void usage(oschar* argv[])
 
 #ifndef WIN32
 
-static int decode_utf8(u32 *out, const char *in)
+// Stores a UTF-8 string into a fixed size UTF-16 field, truncating it
+// if necessary without splitting a surrogate pair
+static int set_utf16_field(u16 *out, const char *in, u32 len)
 {
-	u8 code1, code2, code3, code4;
-
-	code1 = *in++;
-	if(code1 < 0x80)
-	{
-		/* 1-byte sequence */
-		*out = code1;
-		return 1;
-	}
-	else if(code1 < 0xC2)
+	size_t inlen = strlen(in);
+	u16 *buf = (u16*)malloc((inlen + 1) * sizeof(u16));
+	if(buf == NULL)
 		return -1;
-	else if(code1 < 0xE0)
-	{
-		/* 2-byte sequence */
-		code2 = *in++;
-		if((code2 & 0xC0) != 0x80)
-			return -1;
-
-		*out = (code1 << 6) + code2 - 0x3080;
-		return 2;
-	}
-	else if(code1 < 0xF0)
-	{
-		/* 3-byte sequence */
-		code2 = *in++;
-		if((code2 & 0xC0) != 0x80)
-			return -1;
-		if(code1 == 0xE0 && code2 < 0xA0)
-			return -1;
-
-		code3 = *in++;
-		if((code3 & 0xC0) != 0x80)
-			return -1;
-
-		*out = (code1 << 12) + (code2 << 6) + code3 - 0xE2080;
-		return 3;
-	}
-	else if(code1 < 0xF5)
-	{
-		/* 4-byte sequence */
-		code2 = *in++;
-		if((code2 & 0xC0) != 0x80)
-			return -1;
-		if(code1 == 0xF0 && code2 < 0x90)
-			return -1;
-		if(code1 == 0xF4 && code2 >= 0x90)
-			return -1;
-
-		code3 = *in++;
-		if((code3 & 0xC0) != 0x80)
-			return -1;
-
-		code4 = *in++;
-		if((code4 & 0xC0) != 0x80)
-			return -1;
-
-		*out = (code1 << 18) + (code2 << 12) + (code3 << 6) + code4 - 0x3C82080;
-		return 4;
-	}
 
-	return -1;
-}
-
-static int encode_utf16(u16 *out, u32 in)
-{
-	if(in < 0x10000)
+	size_t units = utf8_to_utf16(buf, in, inlen);
+	if(units > len)
 	{
-		if(out != NULL)
-			*out++ = le_hword(in);
-		return 1;
-	}
-	else if(in < 0x110000)
-	{
-		if(out != NULL)
-		{
-			*out++ = le_hword((in >> 10) + 0xD7C0);
-			*out++ = le_hword((in & 0x3FF) + 0xDC00);
-		}
-		return 2;
+		units = len;
+		if(buf[units-1] >= 0xD800 && buf[units-1] < 0xDC00)
+			units--;
 	}
 
-	return -1;
-}
-
-int utf8_to_utf16(u16 *out, const char *in, u32 len)
-{
-	int rc = 0;
-	int units;
-	u32 code;
-	u16 encoded[2];
-
-	do
-	{
-		units = decode_utf8(&code, in);
-		if(units == -1)
-			return -1;
-
-		if(code > 0)
-		{
-			in += units;
-
-			units = encode_utf16(encoded, code);
-			if(units == -1)
-				return -1;
-
-			if(out != NULL)
-			{
-				if(rc + units <= len)
-				{
-					*out++ = encoded[0];
-					if(units > 1)
-						*out++ = encoded[1];
-				}
-			}
-
-			rc += units;
-		}
-	} while(code > 0);
+	size_t i;
+	for(i=0; i<units; i++)
+		out[i] = le_hword(buf[i]);
 
-	return rc;
+	free(buf);
+	return units;
 }
 
 #endif
@@ -420,9 +322,9 @@ int create_hb_banner(oschar* argv[])
 	size_t i;
 	for(i=0; i<16; i++) {
 #ifndef WIN32
-		utf8_to_utf16(hdr.titles[i].short_desc, argv[2], 0x40);
-		utf8_to_utf16(hdr.titles[i].long_desc,  argv[3], 0x80);
-		utf8_to_utf16(hdr.titles[i].publisher,  argv[4], 0x40);
+		set_utf16_field(hdr.titles[i].short_desc, argv[2], 0x40);
+		set_utf16_field(hdr.titles[i].long_desc,  argv[3], 0x80);
+		set_utf16_field(hdr.titles[i].publisher,  argv[4], 0x40);
 #else
 		wcsncpy((oschar*)hdr.titles[i].short_desc, argv[2], 0x40);
 		wcsncpy((oschar*)hdr.titles[i].long_desc,  argv[3], 0x80);
@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "threadpool.h"
+
+static pthread_key_t workerKey;
+static pthread_once_t workerKeyOnce = PTHREAD_ONCE_INIT;
+
+static void createWorkerKey(void)
+{
+	pthread_key_create(&workerKey, NULL);
+}
+
+ThreadPool::ThreadPool(int numThreads) :
+	queues(), threads(), outstanding(0), helpers(1), quit(false), workerArgs()
+{
+	pthread_once(&workerKeyOnce, createWorkerKey);
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+
+	if (numThreads <= 0) numThreads = CpuCount();
+	int numWorkers = numThreads - 1;
+
+	queues.resize(numWorkers + 1);
+	for (unsigned i = 0; i < queues.size(); i ++)
+	{
+		queues[i] = new Queue;
+		pthread_mutex_init(&queues[i]->lock, NULL);
+	}
+
+	// The argument array must not move once the workers have started
+	workerArgs.resize(numWorkers);
+	for (int i = 0; i < numWorkers; i ++)
+	{
+		workerArgs[i].pool = this;
+		workerArgs[i].id = i + 1;
+
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, WorkerMain, &workerArgs[i]) != 0)
+			break; // Run with fewer threads, Wait() still drains everything
+		threads.push_back(thread);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	pthread_mutex_lock(&lock);
+	quit = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+
+	for (unsigned i = 0; i < threads.size(); i ++)
+		pthread_join(threads[i], NULL);
+
+	for (unsigned i = 0; i < queues.size(); i ++)
+	{
+		pthread_mutex_destroy(&queues[i]->lock);
+		delete queues[i];
+	}
+
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+int ThreadPool::CpuCount()
+{
+#ifdef WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	int count = info.dwNumberOfProcessors;
+#else
+	int count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return count > 0 ? count : 1;
+}
+
+unsigned ThreadPool::CurrentQueue()
+{
+	WorkerArg* arg = (WorkerArg*)pthread_getspecific(workerKey);
+	return (arg && arg->pool == this) ? arg->id : 0;
+}
+
+void ThreadPool::Submit(TaskFunc func, void* arg, TaskGroup* group)
+{
+	Task task;
+	task.func = func;
+	task.arg = arg;
+	task.group = group;
+
+	// Account for the task before it becomes visible to thieves
+	pthread_mutex_lock(&lock);
+	outstanding ++;
+	if (group) group->outstanding ++;
+	pthread_mutex_unlock(&lock);
+
+	Queue* q = queues[CurrentQueue()];
+	pthread_mutex_lock(&q->lock);
+	q->tasks.push_back(task);
+	pthread_mutex_unlock(&q->lock);
+
+	pthread_mutex_lock(&lock);
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+bool ThreadPool::TakeTask(unsigned id, Task& task)
+{
+	// Newest task from our own queue first, it is the most likely to be cache-hot
+	Queue* q = queues[id];
+	pthread_mutex_lock(&q->lock);
+	bool found = !q->tasks.empty();
+	if (found)
+	{
+		task = q->tasks.back();
+		q->tasks.pop_back();
+	}
+	pthread_mutex_unlock(&q->lock);
+	if (found) return true;
+
+	// Otherwise steal the oldest task from somebody else
+	for (unsigned i = 1; i < queues.size(); i ++)
+	{
+		q = queues[(id + i) % queues.size()];
+		pthread_mutex_lock(&q->lock);
+		found = !q->tasks.empty();
+		if (found)
+		{
+			task = q->tasks.front();
+			q->tasks.pop_front();
+		}
+		pthread_mutex_unlock(&q->lock);
+		if (found) return true;
+	}
+
+	return false;
+}
+
+// Must be called with the pool lock held
+bool ThreadPool::HasQueuedTasks()
+{
+	bool queued = false;
+	for (unsigned i = 0; !queued && i < queues.size(); i ++)
+	{
+		Queue* q = queues[i];
+		pthread_mutex_lock(&q->lock);
+		queued = !q->tasks.empty();
+		pthread_mutex_unlock(&q->lock);
+	}
+	return queued;
+}
+
+void ThreadPool::RunTask(Task& task)
+{
+	task.func(task.arg);
+
+	pthread_mutex_lock(&lock);
+	bool idle = --outstanding == 0;
+	if (task.group && --task.group->outstanding == 0)
+		idle = true;
+	if (idle)
+		pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void* ThreadPool::WorkerMain(void* arg)
+{
+	WorkerArg* self = (WorkerArg*)arg;
+	ThreadPool* pool = self->pool;
+	pthread_setspecific(workerKey, self);
+
+	for (;;)
+	{
+		Task task;
+		if (pool->TakeTask(self->id, task))
+		{
+			pool->RunTask(task);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		if (pool->quit)
+		{
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		// Tasks may have been queued since we looked; only sleep if nothing is left
+		if (!pool->HasQueuedTasks())
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return NULL;
+}
+
+void ThreadPool::Wait(TaskGroup* group)
+{
+	int* count = group ? &group->outstanding : &outstanding;
+	unsigned id = CurrentQueue();
+	for (;;)
+	{
+		// Check first, there is no point in running other groups' tasks
+		// once our own are done
+		pthread_mutex_lock(&lock);
+		bool done = *count == 0;
+		pthread_mutex_unlock(&lock);
+		if (done) break;
+
+		Task task;
+		if (TakeTask(id, task))
+		{
+			RunTask(task);
+			continue;
+		}
+
+		pthread_mutex_lock(&lock);
+		if (*count && !HasQueuedTasks())
+		{
+			// Tasks are still running elsewhere; they may spawn more work for us
+			pthread_cond_wait(&cond, &lock);
+		}
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+IoLimit::IoLimit(int slots) : slots(slots > 0 ? slots : 1)
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+IoLimit::~IoLimit()
+{
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void IoLimit::Acquire()
+{
+	pthread_mutex_lock(&lock);
+	while (!slots)
+		pthread_cond_wait(&cond, &lock);
+	slots --;
+	pthread_mutex_unlock(&lock);
+}
+
+void IoLimit::Release()
+{
+	pthread_mutex_lock(&lock);
+	slots ++;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
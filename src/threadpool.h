@@ -0,0 +1,107 @@
+#pragma once
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+typedef void (*TaskFunc)(void* arg);
+
+// Counts the unfinished tasks submitted with it, so that one user of a
+// shared pool can wait for its own work without waiting for everybody's
+struct TaskGroup
+{
+	int outstanding;
+
+	TaskGroup() : outstanding(0) { }
+};
+
+// Work-stealing thread pool. Every worker owns a deque: tasks submitted from
+// a worker go to the back of its own deque and are popped LIFO by it, while
+// idle workers steal from the front of the others. Threads calling Wait()
+// help out with pending tasks, so a pool of N threads runs N-1 workers.
+// Waiting on a group returns once its tasks are done, tasks of other groups
+// may have been run in the meantime.
+class ThreadPool
+{
+	struct Task
+	{
+		TaskFunc func;
+		void* arg;
+		TaskGroup* group;
+	};
+
+	struct Queue
+	{
+		pthread_mutex_t lock;
+		std::deque<Task> tasks;
+	};
+
+	std::vector<Queue*> queues; // queues[0] is shared by non-worker threads
+	std::vector<pthread_t> threads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int outstanding; // Submitted but not yet finished
+	int helpers;     // Threads from outside that run tasks while waiting
+	bool quit;
+
+	struct WorkerArg
+	{
+		ThreadPool* pool;
+		unsigned id;
+	};
+	std::vector<WorkerArg> workerArgs;
+
+	static void* WorkerMain(void* arg);
+
+	unsigned CurrentQueue();
+	bool TakeTask(unsigned id, Task& task);
+	bool HasQueuedTasks();
+	void RunTask(Task& task);
+
+public:
+	ThreadPool(int numThreads);
+	~ThreadPool();
+
+	int NumThreads() { return (int)threads.size() + 1; }
+	// Upper bound on the tasks running at once, for splitting up memory
+	int NumExecutors() { return (int)threads.size() + helpers; }
+	// Number of threads outside the pool that wait on it, 1 by default
+	void SetHelpers(int count) { helpers = count > 0 ? count : 1; }
+
+	void Submit(TaskFunc func, void* arg, TaskGroup* group = NULL);
+	// Without a group, waits until the pool is idle
+	void Wait(TaskGroup* group = NULL);
+
+	static int CpuCount();
+};
+
+// Set by a task that fails, so that the others can give up early and the
+// submitter knows once they are done. Accessed atomically, as tasks on
+// different threads set and test it at the same time.
+class FailFlag
+{
+	int failed;
+
+public:
+	FailFlag() : failed(0) { }
+
+	void Set() { __atomic_store_n(&failed, 1, __ATOMIC_RELAXED); }
+	bool IsSet() { return __atomic_load_n(&failed, __ATOMIC_RELAXED) != 0; }
+};
+
+// Counting semaphore bounding the number of threads doing file I/O at the
+// same time. It must not be held while waiting on a pool: the waiting
+// thread helps with other tasks, which may need a slot themselves.
+class IoLimit
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int slots;
+
+public:
+	IoLimit(int slots);
+	~IoLimit();
+
+	void Acquire();
+	void Release();
+};
@@ -9,6 +9,7 @@ typedef int64_t dlong_t;
 typedef int32_t long_t;
 typedef int16_t short_t;
 typedef int8_t char_t;
+typedef int64_t s64;
 typedef uint64_t u64;
 typedef uint32_t u32;
 typedef uint16_t u16;
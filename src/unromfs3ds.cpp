@@ -0,0 +1,505 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "types.h"
+#include "romfs.h"
+#include "romfsreader.h"
+#include "threadpool.h"
+#include "lz11.h"
+
+#ifdef WIN32
+#include <direct.h>
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#define die(msg) do { fputs(msg "\n\n", stderr); return 1; } while(0)
+#define safe_call(a) do { int rc = a; if(rc != 0) return rc; } while(0)
+
+struct argInfo
+{
+	char* inFile;
+	char* outDir;
+	char* catPath;
+	char* benchList;
+	bool list, bench;
+	int threads;
+	u64 offset;
+	std::vector<std::string> lz11;
+};
+
+int usage(const char* progName)
+{
+	fprintf(stderr,
+		"Usage:\n"
+		"    %s input.romfs output_dir [options]\n"
+		"    %s input.romfs --list [options]\n"
+		"    %s input.romfs --cat=PATH [options]\n"
+		"    %s input.romfs --bench[=LIST] [options]\n\n"
+		"Options:\n"
+		"    --threads=N       : Number of threads writing out files (default: one per CPU).\n"
+		"    --offset=N        : Offset of the RomFS image within the input file (default: 0).\n"
+		"    --lz11=EXTS       : Decompress the LZ11 compressed files with one of the comma separated\n"
+		"                        extensions (e.g. bcstm,bin) while extracting.\n"
+		"    --list            : Print every entry of the image and the size of every file.\n"
+		"    --cat=PATH        : Look up a single file the way the console does and write it to stdout.\n"
+		"    --bench[=LIST]    : Replay the lookups of every file, or of the paths listed one per line in\n"
+		"                        LIST, and report the hash chain probes, metadata cache lines (64 bytes)\n"
+		"                        and sectors (0x200 bytes) touched and the time taken per lookup.\n"
+		, progName, progName, progName, progName);
+	return 1;
+}
+
+int parseArgs(argInfo& info, int argc, char* argv[])
+{
+	info.inFile = NULL;
+	info.outDir = NULL;
+	info.catPath = NULL;
+	info.benchList = NULL;
+	info.list = false;
+	info.bench = false;
+	info.threads = 0;
+	info.offset = 0;
+
+	int status = 0;
+	for (int i = 1; i < argc; i ++)
+	{
+		char* arg = argv[i];
+		if (arg[0] == '-' && arg[1] == '-')
+		{
+			arg += 2;
+			char* value = strchr(arg, '=');
+			if (value)
+			{
+				*value++ = 0;
+				if (!*value) return usage(argv[0]);
+			}
+
+			if (!value)
+			{
+				if (strcmp(arg, "list")==0)
+					info.list = true;
+				else if (strcmp(arg, "bench")==0)
+					info.bench = true;
+				else
+					return usage(argv[0]);
+			}
+			else if (strcmp(arg, "threads")==0)
+				info.threads = atoi(value);
+			else if (strcmp(arg, "offset")==0)
+				info.offset = strtoull(value, NULL, 0);
+			else if (strcmp(arg, "lz11")==0)
+			{
+				if (!lz11_parse_exts(value, info.lz11)) return usage(argv[0]);
+			}
+			else if (strcmp(arg, "cat")==0)
+				info.catPath = value;
+			else if (strcmp(arg, "bench")==0)
+			{
+				info.bench = true;
+				info.benchList = value;
+			}
+			else
+				return usage(argv[0]);
+		} else
+		{
+			switch (status++)
+			{
+				case 0: info.inFile = arg; break;
+				case 1: info.outDir = arg; break;
+				default: return usage(argv[0]);
+			}
+		}
+	}
+
+	int modes = (info.outDir != NULL) + info.list + (info.catPath != NULL) + info.bench;
+	return !info.inFile || modes != 1 ? usage(argv[0]) : 0;
+}
+
+// Names come straight from the image and must not be able to escape the
+// output directory
+static bool isSafeName(const u8* name, u32 len)
+{
+	if (len == 0) return false;
+	if (name[0] == '.' && !name[1] && (len == 1 || (len == 2 && name[2] == '.' && !name[3])))
+		return false;
+	for (u32 i = 0; i < len; i ++)
+	{
+		u16 c = name[i*2] | name[i*2+1] << 8;
+		if (c == 0 || c == '/' || c == '\\')
+			return false;
+#ifdef WIN32
+		// Drive letters and alternate data streams
+		if (c == ':')
+			return false;
+#endif
+	}
+	return true;
+}
+
+static osstring hostName(const u8* name, u32 len)
+{
+#ifdef WIN32
+	osstring out;
+	for (u32 i = 0; i < len; i ++)
+		out += (WCHAR)(name[i*2] | name[i*2+1] << 8);
+	return out;
+#else
+	std::string out;
+	romfsNameToUtf8(out, name, len);
+	return out;
+#endif
+}
+
+static int makeDir(const osstring& path)
+{
+#ifdef WIN32
+	int rc = _wmkdir(path.c_str());
+#else
+	int rc = mkdir(path.c_str(), 0777);
+#endif
+	if (rc < 0 && errno != EEXIST)
+	{
+#ifdef WIN32
+		fwprintf(stderr, L"Cannot create directory %ls!\n", path.c_str());
+#else
+		fprintf(stderr, "Cannot create directory %s!\n", path.c_str());
+#endif
+		return 1;
+	}
+	return 0;
+}
+
+struct extract_task_t
+{
+	const RomFSReader* reader;
+	u32 file;
+	osstring path;
+	bool decompress;
+	FailFlag* failed;
+};
+
+static void extractTask(void* arg)
+{
+	extract_task_t* task = (extract_task_t*)arg;
+	romfs_file_info_t file;
+	if (task->reader->GetFile(task->file, file) != 0)
+	{
+		task->failed->Set();
+		return;
+	}
+
+	// The data is written straight out of the mapped image
+	const u8* data = task->reader->FileData(file);
+	u64 size = file.dataSize;
+	std::vector<u8> buf;
+	if (task->decompress)
+	{
+		if (!lz11_decompress(data, size, buf))
+		{
+#ifdef WIN32
+			fwprintf(stderr, L"File %ls is not LZ11 compressed!\n", task->path.c_str());
+#else
+			fprintf(stderr, "File %s is not LZ11 compressed!\n", task->path.c_str());
+#endif
+			task->failed->Set();
+			return;
+		}
+		data = buf.empty() ? NULL : &buf.front();
+		size = buf.size();
+	}
+
+	FILE* f = osfopen(task->path.c_str(), "wb");
+	bool rc = f != NULL;
+	if (rc && size)
+		rc = fwrite(data, 1, size, f) == size;
+	if (f && fclose(f) != 0)
+		rc = false;
+
+	if (!rc)
+	{
+#ifdef WIN32
+		fwprintf(stderr, L"Could not write file %ls!\n", task->path.c_str());
+#else
+		fprintf(stderr, "Could not write file %s!\n", task->path.c_str());
+#endif
+		task->failed->Set();
+	}
+}
+
+// Creates the directory tree serially, as parents have to exist before
+// their children, and queues every file to be written out on the pool
+static int extract(const RomFSReader& reader, const osstring& outDir, int threads, const std::vector<std::string>& lz11)
+{
+	std::vector<extract_task_t> tasks;
+	std::vector< std::pair<u32, osstring> > stack;
+	FailFlag failed;
+	u32 dirCount = 0;
+
+	safe_call(makeDir(outDir));
+	stack.push_back(std::make_pair(0u, outDir));
+	while (!stack.empty())
+	{
+		u32 off = stack.back().first;
+		osstring path = stack.back().second;
+		stack.pop_back();
+
+		romfs_dir_info_t dir;
+		safe_call(reader.GetDir(off, dir));
+
+		for (u32 child = dir.firstFile; child != ROMFS_NONE; )
+		{
+			romfs_file_info_t file;
+			safe_call(reader.GetFile(child, file));
+			if (!isSafeName(file.name, file.nameLen)) die("Unsafe file name in RomFS image");
+
+			extract_task_t task;
+			task.reader = &reader;
+			task.file = child;
+			task.path = path + OSWILDCARD[0] + hostName(file.name, file.nameLen);
+			task.decompress = false;
+			task.failed = &failed;
+			if (!lz11.empty())
+			{
+				std::vector<u16> name(file.nameLen);
+				for (u32 i = 0; i < file.nameLen; i ++)
+					name[i] = file.name[i*2] | file.name[i*2+1] << 8;
+				task.decompress = lz11_match_ext(lz11, name.empty() ? NULL : &name.front(), file.nameLen);
+			}
+			tasks.push_back(task);
+
+			if (tasks.size() > reader.MaxFiles()) die("Corrupted RomFS image");
+			child = file.sibling;
+		}
+
+		for (u32 child = dir.firstSubDir; child != ROMFS_NONE; )
+		{
+			romfs_dir_info_t sub;
+			safe_call(reader.GetDir(child, sub));
+			if (!isSafeName(sub.name, sub.nameLen)) die("Unsafe directory name in RomFS image");
+
+			osstring subPath = path + OSWILDCARD[0] + hostName(sub.name, sub.nameLen);
+			safe_call(makeDir(subPath));
+			stack.push_back(std::make_pair(child, subPath));
+			if (++dirCount > reader.MaxDirs()) die("Corrupted RomFS image");
+			child = sub.sibling;
+		}
+	}
+
+	ThreadPool pool(threads);
+	for (size_t i = 0; i < tasks.size(); i ++)
+		pool.Submit(extractTask, &tasks[i]);
+	pool.Wait();
+
+	return failed.IsSet() ? 1 : 0;
+}
+
+struct list_ent_t
+{
+	std::string path; // UTF-8 path inside the image
+	bool isDir;
+	u64 size;
+};
+
+// Lists every entry in table order, directories before their contents
+static int walkTree(const RomFSReader& reader, std::vector<list_ent_t>& out)
+{
+	std::vector< std::pair<u32, std::string> > stack;
+	u32 dirCount = 0, fileCount = 0;
+	stack.push_back(std::make_pair(0u, std::string()));
+	while (!stack.empty())
+	{
+		u32 off = stack.back().first;
+		list_ent_t ent;
+		ent.path = stack.back().second;
+		ent.isDir = true;
+		ent.size = 0;
+		stack.pop_back();
+
+		romfs_dir_info_t dir;
+		safe_call(reader.GetDir(off, dir));
+		out.push_back(ent);
+
+		for (u32 child = dir.firstFile; child != ROMFS_NONE; )
+		{
+			romfs_file_info_t file;
+			safe_call(reader.GetFile(child, file));
+			list_ent_t fileEnt;
+			fileEnt.path = ent.path + "/";
+			romfsNameToUtf8(fileEnt.path, file.name, file.nameLen);
+			fileEnt.isDir = false;
+			fileEnt.size = file.dataSize;
+			out.push_back(fileEnt);
+			if (++fileCount > reader.MaxFiles()) die("Corrupted RomFS image");
+			child = file.sibling;
+		}
+
+		// Pushed in reverse so that they come out in table order
+		size_t first = stack.size();
+		for (u32 child = dir.firstSubDir; child != ROMFS_NONE; )
+		{
+			romfs_dir_info_t sub;
+			safe_call(reader.GetDir(child, sub));
+			std::string subPath = ent.path + "/";
+			romfsNameToUtf8(subPath, sub.name, sub.nameLen);
+			stack.push_back(std::make_pair(child, subPath));
+			if (++dirCount > reader.MaxDirs()) die("Corrupted RomFS image");
+			child = sub.sibling;
+		}
+		std::reverse(stack.begin() + first, stack.end());
+	}
+	return 0;
+}
+
+static int list(const RomFSReader& reader)
+{
+	std::vector<list_ent_t> ents;
+	safe_call(walkTree(reader, ents));
+	for (size_t i = 0; i < ents.size(); i ++)
+	{
+		if (ents[i].isDir)
+			printf("-\t%s/\n", ents[i].path.c_str());
+		else
+			printf("%llu\t%s\n", (unsigned long long)ents[i].size, ents[i].path.c_str());
+	}
+	return 0;
+}
+
+static double now(void)
+{
+#ifdef WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+// Replays file lookups the way the console resolves them and reports how
+// much of the metadata each one has to walk through
+static int bench(const RomFSReader& reader, const char* listFile)
+{
+	std::vector<std::string> paths;
+	if (listFile)
+	{
+		FILE* f = fopen(listFile, "r");
+		if (!f) die("Cannot open path list");
+		char buf[4096];
+		while (fgets(buf, sizeof(buf), f))
+		{
+			buf[strcspn(buf, "\r\n")] = 0;
+			if (*buf) paths.push_back(buf);
+		}
+		fclose(f);
+	} else
+	{
+		std::vector<list_ent_t> ents;
+		safe_call(walkTree(reader, ents));
+		for (size_t i = 0; i < ents.size(); i ++)
+			if (!ents[i].isDir)
+				paths.push_back(ents[i].path);
+	}
+	if (paths.empty()) die("Nothing to look up");
+
+	u32 found = 0, maxProbes = 0;
+	u64 probes = 0, lines = 0, sectors = 0;
+	std::vector<u64> allLines, allSectors, units;
+	for (size_t i = 0; i < paths.size(); i ++)
+	{
+		romfs_trace_t trace;
+		u32 off;
+		if (reader.LookupFile(paths[i].c_str(), off, &trace) == 0)
+			found ++;
+		probes += trace.probes;
+		if (trace.probes > maxProbes) maxProbes = trace.probes;
+
+		units.clear();
+		trace.TouchedUnits(ROMFS_CACHE_LINE_SIZE, units);
+		lines += romfsCountDistinct(units);
+		allLines.insert(allLines.end(), units.begin(), units.end());
+
+		units.clear();
+		trace.TouchedUnits(ROMFS_SECTOR_SIZE, units);
+		sectors += romfsCountDistinct(units);
+		allSectors.insert(allSectors.end(), units.begin(), units.end());
+	}
+
+	// Keep replaying the whole list for a while to get a stable timing
+	u64 lookups = 0;
+	double start = now(), elapsed;
+	do
+	{
+		for (size_t i = 0; i < paths.size(); i ++)
+		{
+			u32 off;
+			reader.LookupFile(paths[i].c_str(), off);
+		}
+		lookups += paths.size();
+		elapsed = now() - start;
+	} while (elapsed < 0.5);
+
+	double count = paths.size();
+	printf("Looked up %u paths, %u found\n", (u32)paths.size(), found);
+	printf("  hash chain probes: %.2f per lookup, max %u\n", probes / count, maxProbes);
+	printf("  touched per lookup: %.2f cache lines (%d bytes), %.2f sectors (0x%X bytes)\n",
+		lines / count, ROMFS_CACHE_LINE_SIZE, sectors / count, ROMFS_SECTOR_SIZE);
+	printf("  touched in total: %u cache lines, %u sectors\n",
+		(u32)romfsCountDistinct(allLines), (u32)romfsCountDistinct(allSectors));
+	printf("  time: %.1f ns per lookup\n", elapsed * 1e9 / lookups);
+	return 0;
+}
+
+static int cat(const RomFSReader& reader, const char* path)
+{
+	u32 off;
+	if (reader.LookupFile(path, off) != 0)
+	{
+		fprintf(stderr, "No such file in RomFS image: %s\n", path);
+		return 1;
+	}
+
+	romfs_file_info_t file;
+	safe_call(reader.GetFile(off, file));
+#ifdef WIN32
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	if (file.dataSize && fwrite(reader.FileData(file), 1, file.dataSize, stdout) != file.dataSize)
+		die("Could not write output");
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	argInfo args;
+	safe_call(parseArgs(args, argc, argv));
+
+	RomFSReader reader;
+#ifdef WIN32
+	WCHAR inFile[OSPATHLEN], outDir[OSPATHLEN];
+	if (!MultiByteToWideChar(CP_ACP, 0, args.inFile, -1, inFile, OSPATHLEN))
+		die("Cannot convert to Unicode");
+	if (args.outDir && !MultiByteToWideChar(CP_ACP, 0, args.outDir, -1, outDir, OSPATHLEN))
+		die("Cannot convert to Unicode");
+#else
+	const char* inFile = args.inFile;
+	const char* outDir = args.outDir;
+#endif
+	safe_call(reader.Open(inFile, args.offset));
+
+	if (args.list)
+		return list(reader);
+	if (args.catPath)
+		return cat(reader, args.catPath);
+	if (args.bench)
+		return bench(reader, args.benchList);
+	return extract(reader, outDir, args.threads, args.lz11);
+}
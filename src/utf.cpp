@@ -0,0 +1,213 @@
+#include <string.h>
+#include "utf.h"
+
+// The fast path widens a whole block of ASCII characters at once and bails
+// out as soon as the block contains a single non-ASCII byte
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define ASCII_BLOCK 32
+
+static inline bool widenAscii(u16* out, const u8* in)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i*)in);
+	if (_mm256_movemask_epi8(v)) return false;
+	_mm256_storeu_si256((__m256i*)out, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+	_mm256_storeu_si256((__m256i*)(out + 16), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+	return true;
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define ASCII_BLOCK 16
+
+static inline bool widenAscii(u16* out, const u8* in)
+{
+	__m128i v = _mm_loadu_si128((const __m128i*)in);
+	if (_mm_movemask_epi8(v)) return false;
+	__m128i zero = _mm_setzero_si128();
+	_mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi8(v, zero));
+	_mm_storeu_si128((__m128i*)(out + 8), _mm_unpackhi_epi8(v, zero));
+	return true;
+}
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define ASCII_BLOCK 16
+
+static inline bool widenAscii(u16* out, const u8* in)
+{
+	uint8x16_t v = vld1q_u8(in);
+	uint8x8_t any = vorr_u8(vget_low_u8(v), vget_high_u8(v));
+	if (vget_lane_u64(vreinterpret_u64_u8(any), 0) & 0x8080808080808080ULL) return false;
+	vst1q_u16(out, vmovl_u8(vget_low_u8(v)));
+	vst1q_u16(out + 8, vmovl_u8(vget_high_u8(v)));
+	return true;
+}
+#else
+#define ASCII_BLOCK 8
+
+static inline bool widenAscii(u16* out, const u8* in)
+{
+	u64 v;
+	memcpy(&v, in, 8);
+	if (v & 0x8080808080808080ULL) return false;
+	for (int i = 0; i < 8; i ++)
+		out[i] = in[i];
+	return true;
+}
+#endif
+
+// Function written by mtheall, bounded by end instead of a NUL terminator
+static int decode_utf8(u32 *out, const u8 *in, const u8 *end)
+{
+	u8 code1, code2, code3, code4;
+	ptrdiff_t avail = end - in;
+
+	code1 = *in++;
+	if (code1 < 0x80)
+	{
+		// 1-byte sequence
+		*out = code1;
+		return 1;
+	} else if (code1 < 0xC2)
+		return -1;
+	else if (code1 < 0xE0)
+	{
+		// 2-byte sequence
+		if (avail < 2)
+			return -1;
+		code2 = *in++;
+		if ((code2 & 0xC0) != 0x80)
+			return -1;
+
+		*out = (code1 << 6) + code2 - 0x3080;
+		return 2;
+	} else if (code1 < 0xF0)
+	{
+		// 3-byte sequence
+		if (avail < 2)
+			return -1;
+		code2 = *in++;
+		if ((code2 & 0xC0) != 0x80)
+			return -1;
+		if (code1 == 0xE0 && code2 < 0xA0)
+			return -1;
+
+		if (avail < 3)
+			return -1;
+		code3 = *in++;
+		if ((code3 & 0xC0) != 0x80)
+			return -1;
+
+		*out = (code1 << 12) + (code2 << 6) + code3 - 0xE2080;
+		return 3;
+	} else if (code1 < 0xF5)
+	{
+		// 4-byte sequence
+		if (avail < 2)
+			return -1;
+		code2 = *in++;
+		if ((code2 & 0xC0) != 0x80)
+			return -1;
+		if (code1 == 0xF0 && code2 < 0x90)
+			return -1;
+		if (code1 == 0xF4 && code2 >= 0x90)
+			return -1;
+
+		if (avail < 3)
+			return -1;
+		code3 = *in++;
+		if ((code3 & 0xC0) != 0x80)
+			return -1;
+
+		if (avail < 4)
+			return -1;
+		code4 = *in++;
+		if ((code4 & 0xC0) != 0x80)
+			return -1;
+
+		*out = (code1 << 18) + (code2 << 12) + (code3 << 6) + code4 - 0x3C82080;
+		return 4;
+	}
+
+	return -1;
+}
+
+static inline u16* convertOne(u16* out, const u8*& in, const u8* end)
+{
+	u32 code;
+	int units = decode_utf8(&code, in, end);
+	if (units == -1)
+	{
+		*out++ = 0xFFFD; // Replacement character
+		in ++;
+		return out;
+	}
+	in += units;
+
+	// Encode Unicode codepoint as UTF-16
+	if (code < 0x10000)
+		*out++ = code;
+	else
+	{
+		*out++ = (code >> 10) + 0xD7C0;
+		*out++ = (code & 0x3FF) + 0xDC00;
+	}
+	return out;
+}
+
+size_t utf8_to_utf16(u16* out, const char* str, size_t len)
+{
+	const u8* in = (const u8*)str;
+	const u8* end = in + len;
+	u16* start = out;
+
+	while (end - in >= ASCII_BLOCK)
+	{
+		if (widenAscii(out, in))
+		{
+			in += ASCII_BLOCK;
+			out += ASCII_BLOCK;
+			continue;
+		}
+
+		// Get past the offending block before trying the fast path again
+		const u8* blockEnd = in + ASCII_BLOCK;
+		while (in < blockEnd)
+			out = convertOne(out, in, end);
+	}
+
+	while (in < end)
+		out = convertOne(out, in, end);
+
+	return out - start;
+}
+
+void utf16_to_utf8(std::string& out, const u16* in, size_t len)
+{
+	for (size_t i = 0; i < len; i ++)
+	{
+		u32 code = in[i];
+		if (code >= 0xD800 && code < 0xDC00 && i+1 < len && in[i+1] >= 0xDC00 && in[i+1] < 0xE000)
+			code = 0x10000 + ((code - 0xD800) << 10) + (in[++i] - 0xDC00);
+		else if (code >= 0xD800 && code < 0xE000)
+			code = 0xFFFD; // Unpaired surrogate
+
+		if (code < 0x80)
+			out += (char)code;
+		else if (code < 0x800)
+		{
+			out += (char)(0xC0 | (code >> 6));
+			out += (char)(0x80 | (code & 0x3F));
+		} else if (code < 0x10000)
+		{
+			out += (char)(0xE0 | (code >> 12));
+			out += (char)(0x80 | ((code >> 6) & 0x3F));
+			out += (char)(0x80 | (code & 0x3F));
+		} else
+		{
+			out += (char)(0xF0 | (code >> 18));
+			out += (char)(0x80 | ((code >> 12) & 0x3F));
+			out += (char)(0x80 | ((code >> 6) & 0x3F));
+			out += (char)(0x80 | (code & 0x3F));
+		}
+	}
+}
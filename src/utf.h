@@ -0,0 +1,13 @@
+#pragma once
+#include <stddef.h>
+#include <string>
+#include "types.h"
+
+// Converts len bytes of UTF-8 into UTF-16 in host byte order. Every byte
+// that does not start a valid sequence becomes U+FFFD. A UTF-8 string never
+// needs more UTF-16 units than it has bytes, so out must have room for len
+// units. Returns the number of units written.
+size_t utf8_to_utf16(u16* out, const char* in, size_t len);
+
+// Appends UTF-16 text as UTF-8, unpaired surrogates become U+FFFD
+void utf16_to_utf8(std::string& out, const u16* in, size_t len);
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <errno.h>
+#include "zerocopy.h"
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+
+// The kernel refuses the operation for this pair of files, as opposed to an I/O error
+static bool isUnsupported(int err)
+{
+	return err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP || err == EBADF;
+}
+
+int zeroCopyTarget(FILE* out)
+{
+	int fd = fileno(out);
+	struct stat statbuf;
+	if (fd < 0 || fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+		return -1;
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || (flags & O_APPEND))
+		return -1;
+	return fd;
+}
+
+int zeroCopyRange(int outFd, u64 outOff, int inFd, u64 inOff, u64 size)
+{
+	u64 done = 0;
+
+#ifdef FICLONERANGE
+	// Share whole blocks if both files live on the same reflink-capable volume
+	struct stat statbuf;
+	if (fstat(outFd, &statbuf) == 0 && statbuf.st_blksize > 0)
+	{
+		u64 blkSize = statbuf.st_blksize;
+		u64 cloneLen = size - size % blkSize;
+		if (cloneLen && outOff % blkSize == 0 && inOff % blkSize == 0)
+		{
+			struct file_clone_range range;
+			range.src_fd = inFd;
+			range.src_offset = inOff;
+			range.src_length = cloneLen;
+			range.dest_offset = outOff;
+			if (ioctl(outFd, FICLONERANGE, &range) == 0)
+				done = cloneLen;
+		}
+	}
+#endif
+
+	bool useCopyRange = true;
+	while (done < size)
+	{
+		u64 chunk = size - done;
+		if (chunk > 0x40000000) chunk = 0x40000000;
+
+		ssize_t n;
+		if (useCopyRange)
+		{
+#ifdef __NR_copy_file_range
+			loff_t inPos = inOff + done, outPos = outOff + done;
+			n = syscall(__NR_copy_file_range, inFd, &inPos, outFd, &outPos, (size_t)chunk, 0);
+#else
+			n = -1;
+			errno = ENOSYS;
+#endif
+			if (n < 0 && isUnsupported(errno))
+			{
+				useCopyRange = false;
+				continue;
+			}
+		} else
+		{
+			// sendfile() writes at the current file offset of the output
+			if (lseek(outFd, outOff + done, SEEK_SET) < 0)
+				return 1;
+			off_t inPos = inOff + done;
+			n = sendfile(outFd, inFd, &inPos, (size_t)chunk);
+			if (n < 0 && isUnsupported(errno))
+				return -1;
+		}
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 1; // Read error, or the input is shorter than expected
+		done += n;
+	}
+
+	return 0;
+}
+
+int zeroCopyFile(int outFd, u64 outOff, const oschar_t* path, u64 inOff, u64 size, u32 pad, bool sparse)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Could not open file %s!\n", path);
+		return 1;
+	}
+
+	int rc = 0;
+	if (sparse)
+	{
+		// Only the runs of actual data, the holes stay holes
+		u64 pos = inOff, end = inOff + size, dataEnd;
+		while (rc == 0 && findData(fd, pos, end, dataEnd))
+		{
+			rc = zeroCopyRange(outFd, outOff + (pos - inOff), fd, pos, dataEnd - pos);
+			pos = dataEnd;
+		}
+		pad = 0;
+	} else
+		rc = zeroCopyRange(outFd, outOff, fd, inOff, size);
+	close(fd);
+
+	static const u8 zeros[0x1000] = { 0 };
+	for (u64 pos = outOff + size; rc == 0 && pad; )
+	{
+		u32 chunk = pad < sizeof(zeros) ? pad : sizeof(zeros);
+		if (pwrite(outFd, zeros, chunk, pos) != (ssize_t)chunk)
+			rc = 1;
+		pos += chunk;
+		pad -= chunk;
+	}
+
+	if (rc > 0)
+		fprintf(stderr, "Could not read file %s!\n", path);
+	return rc;
+}
+
+int punchHole(int fd, u64 off, u64 size)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (!size || fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, size) == 0)
+		return 0;
+#endif
+	return -1;
+}
+
+#else
+
+int zeroCopyTarget(FILE* out)
+{
+	return -1;
+}
+
+int zeroCopyRange(int outFd, u64 outOff, int inFd, u64 inOff, u64 size)
+{
+	return -1;
+}
+
+int zeroCopyFile(int outFd, u64 outOff, const oschar_t* path, u64 inOff, u64 size, u32 pad, bool sparse)
+{
+	return -1;
+}
+
+int punchHole(int fd, u64 off, u64 size)
+{
+	return -1;
+}
+
+#endif
+
+#ifndef WIN32
+bool findData(int fd, u64& pos, u64 end, u64& dataEnd)
+{
+	dataEnd = end;
+	if (pos >= end) return false;
+#ifdef SEEK_DATA
+	off_t data = lseek(fd, pos, SEEK_DATA);
+	if (data < 0)
+	{
+		// ENXIO means only holes from pos to the end of the file. A file that
+		// ends before end is handed back as data, so the caller's read fails
+		// the same as without holes. Other errors mean no support here.
+		struct stat statbuf;
+		return errno != ENXIO || fstat(fd, &statbuf) != 0 || (u64)statbuf.st_size < end;
+	}
+	if ((u64)data >= end) return false;
+	pos = data;
+	off_t hole = lseek(fd, pos, SEEK_HOLE);
+	if (hole >= 0 && (u64)hole < end)
+		dataEnd = hole;
+#endif
+	return true;
+}
+#endif
@@ -0,0 +1,34 @@
+#pragma once
+#include <stdio.h>
+#include "types.h"
+#include "romfs.h"
+
+// Kernel-side copying of file contents (Linux only). Data moved this way
+// never passes through a user space buffer or stdio; reflinks are tried
+// first, then copy_file_range and finally sendfile.
+
+// Returns the descriptor backing out if it can receive zero-copy transfers,
+// -1 if the caller has to use buffered writes. out must be flushed first.
+int zeroCopyTarget(FILE* out);
+
+// Copies size bytes of inFd starting at inOff to outFd at outOff.
+// Returns 0 on success, 1 on I/O error, -1 if the kernel cannot copy between
+// these two files; the caller then has to write the range itself.
+int zeroCopyRange(int outFd, u64 outOff, int inFd, u64 inOff, u64 size);
+
+// Copies size bytes of a host file starting at inOff, followed by pad zero
+// bytes, with the same return values as zeroCopyRange. With sparse set,
+// holes in the input and the padding are skipped instead of written, so
+// the output range has to read as zeros already.
+int zeroCopyFile(int outFd, u64 outOff, const oschar_t* path, u64 inOff, u64 size, u32 pad, bool sparse = false);
+
+// Deallocates a range of the output, which then reads as zeros. Returns 0
+// on success, -1 if the file system cannot do it.
+int punchHole(int fd, u64 off, u64 size);
+
+#ifndef WIN32
+// Moves pos to the next byte of actual data before end in a possibly sparse
+// file and sets dataEnd to where that run of data stops. Returns false if
+// there are only holes left. Without SEEK_DATA everything counts as data.
+bool findData(int fd, u64& pos, u64 end, u64& dataEnd);
+#endif